@@ -53,73 +53,73 @@ int main (int argc, char *argv[])
 			return 1;
 	}
 
-	// Load wad file and get list of lumps
+	// Load wad file
 	WadFile wadfile;
-	if (!wadfile.load_wad_file(argv[optind]))
+	if (!wadfile.load_wad_file(argv[optind], false, LF_MMAP | LF_INDEX_CACHE))
 		return 2;
-	vector<wfLump> &lumps = wadfile.get_all_lumps();
 
 	// Process all lumps and print information
-	for (unsigned int i = 0; i < lumps.size(); i++)
+	for (int i = 0; i < wadfile.get_num_lumps(); i++)
 	{
-		wfLump &lump = lumps[i];
+		const char *lump_name = wadfile.get_lump_name(i);
+		uint32_t lump_size = wadfile.get_lump_size(i);
 		// Print texture info
 		if (arg_output_textures)
 		{
-			int type = lump.type;
+			int type = wadfile.get_lump_type(i);
 			if ((type == LT_IMAGE_TEXTURE && (arg_output_textures & OTF_DIRECT_TEXTURES)) ||
 				(type == LT_IMAGE_PATCH && (arg_output_textures & OTF_PATCHES)) ||
 				(type == LT_IMAGE_FLAT && (arg_output_textures & OTF_FLATS)))
 			{
 				int width = 0;
 				int height = 0;
-				if (type == LT_IMAGE_FLAT && lump.size == 4096)
+				if (type == LT_IMAGE_FLAT && lump_size == 4096)
 				{	// Raw flat format
 					width = height = 64;
 				}
 				else
 				{
-					char *lump_data = wadfile.get_lump_data(i);
-					if (strncmp(lump_data+1, "PNG", 3) == 0)
+					// Read just enough to get the dimensions (PNG IHDR chunk ends at byte 24)
+					char lump_header[24] = {0};
+					wadfile.read_lump_part(i, lump_header, 0, sizeof(lump_header));
+					if (strncmp(lump_header+1, "PNG", 3) == 0)
 					{	// PNG format
-						width = __builtin_bswap32(*((uint32_t *)(lump_data + 16)));
-						height = __builtin_bswap32(*((uint32_t *)(lump_data + 20)));
+						width = __builtin_bswap32(read_le32(lump_header + 16));
+						height = __builtin_bswap32(read_le32(lump_header + 20));
 					}
 					else
 					{	// Doom format
-						doom_patch_header_t *hdr = (doom_patch_header_t *)lump_data;
+						doom_patch_header_t *hdr = (doom_patch_header_t *)lump_header;
 						width = hdr->width;
 						height = hdr->height;
 					}
 				}
 				if (arg_output_moreinfo)
-					printf("%-8s %4d %4d\n", lump.name.c_str(), width, height);
+					printf("%-8s %4d %4d\n", lump_name, width, height);
 				else
-					printf("%s\n", lump.name.c_str());
+					printf("%s\n", lump_name);
 			}
 		}
 		// Print any lump info
 		else if (arg_output_moreinfo)
 		{
-			printf("%-8s %7d %-8x %s\n", lump.name.c_str(), lump.size, lump.source_file_pos, wfLumpTypeStr[lump.type]);
+			printf("%-8s %7u %-8x %s\n", lump_name, lump_size, wadfile.get_lump_file_pos(i), wfLumpTypeStr[wadfile.get_lump_type(i)]);
 		}
 		else
-			printf("%s\n", lump.name.c_str());
+			printf("%s\n", lump_name);
 	}
 
 	// Process all TEXTUREx lumps
 	if (arg_output_textures & OTF_COMPOSITE_TEXTURES)
 	{
-		wadfile.reset_cursor();
-		int lump_pos;
-		while ((lump_pos = wadfile.find_next_lump_by_type(LT_MISC_TEXTURES)) != -1)
+		for (int lump_pos : wadfile.lumps_by_type(LT_MISC_TEXTURES))
 		{
 			char *lump_data = wadfile.get_lump_data(lump_pos);
-			int num_textures = *((int32_t *)lump_data);
-			uint32_t *offsets = (uint32_t *)(lump_data + 4);
+			int num_textures = (int32_t)read_le32(lump_data);
+			const char *offsets = lump_data + 4;
 			for (int i = 1; i < num_textures; i++) // Skip zero texture (AASHITTY) as it is unusable
 			{
-				maptexture_t *texture = (maptexture_t *)(lump_data + offsets[i]);
+				maptexture_t *texture = (maptexture_t *)(lump_data + read_le32(offsets + i * 4));
 				if (arg_output_moreinfo)
 					printf("%-8.8s %4d %4d\n", texture->name, texture->width, texture->height);
 				else
@@ -24,7 +24,7 @@ int main (int argc, char *argv[])
 	for (int n = 1; n < argc; n++)
 	{
 		WadFile wadfile;
-		if (!wadfile.load_wad_file(argv[n]))
+		if (!wadfile.load_wad_file(argv[n], false, LF_MMAP | LF_INDEX_CACHE))
 			continue;
 
 		// Search for lumps and save them
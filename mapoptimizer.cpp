@@ -6,30 +6,54 @@ int main (int argc, char *argv[])
 {
 	if (argc < 2)
 	{
-		printf("Usage: %s [-S] [-s] [-d] [-r] wadfile [wadfile ...]\n", argv[0]);
+		printf("Usage: %s [-S | -u] [-s] [-d] [-r] [-D] [-a alignment] [-g] [-G] [-j threads] [-t] wadfile [wadfile ...]\n", argv[0]);
 		printf("  -S: Do not save resulting wad, just print statistics\n");
+		printf("  -u: Update the wad in place instead of saving a new one\n");
 		printf("  -s: Join all sectors with same properties (dangerous)\n");
 		printf("  -d: Do not perform sidedef packing\n");
 		printf("  -r: Erase REJECT lump\n");
+		printf("  -D: Store identical lumps only once in resulting wad\n");
+		printf("  -a alignment: Align lump data in resulting wad to given boundary (i.e. 4096)\n");
+		printf("  -g: Store lumps of each map and namespace contiguously in resulting wad\n");
+		printf("  -G: Like -g, but align only start of each map and namespace\n");
+		printf("  -j threads: Number of threads writing resulting wad\n");
+		printf("  -t: Print time spent waiting for reading the wads\n");
 		return 1;
 	}
 
 	// Parse arguments
 	bool arg_dont_save_wad = false;
+	bool arg_update_wad = false;
 	bool arg_join_sectors = false;
 	bool arg_dont_join_sidedefs = false;
 	bool arg_drop_reject = false;
+	bool arg_print_io_wait = false;
+	wfSaveOptions save_options;
 	int c;
-	while ((c = getopt(argc, argv, "Ssdr")) != -1)
+	while ((c = getopt(argc, argv, "SusdrDa:gGj:t")) != -1)
 	{
 		if (c == 'S')
 			arg_dont_save_wad = true;
+		else if (c == 'u')
+			arg_update_wad = true;
 		else if (c == 's')
 			arg_join_sectors = true;
 		else if (c == 'd')
 			arg_dont_join_sidedefs = true;
 		else if (c == 'r')
 			arg_drop_reject = true;
+		else if (c == 'D')
+			save_options.deduplicate = true;
+		else if (c == 'a')
+			save_options.alignment = atoi(optarg);
+		else if (c == 'g')
+			save_options.group_lumps = true;
+		else if (c == 'G')
+			save_options.group_lumps = save_options.align_groups_only = true;
+		else if (c == 'j')
+			save_options.num_threads = atoi(optarg);
+		else if (c == 't')
+			arg_print_io_wait = true;
 		else
 			return 1;
 	}
@@ -40,23 +64,25 @@ int main (int argc, char *argv[])
 	int saved_bytes_sectors = 0;
 	int saved_bytes_sidedefs = 0;
 	int saved_bytes_reject = 0;
+	int saved_bytes_dedup = 0;
 	int total_rejected_sectors = 0;
+	double io_wait_time = 0.0;
 
 	// Process all wads given on commandline
 	for (int n = optind; n < argc; n++)
 	{
 		WadFile wadfile;
-		if (!wadfile.load_wad_file(argv[n]))
+		if (!wadfile.load_wad_file(argv[n], arg_update_wad, LF_MMAP))
 			continue;
 
 		// Process all map lumps
-		int map_lump_pos;
-		while ((map_lump_pos = wadfile.find_next_lump_by_type(LT_MAP_HEADER)) != -1)
+		for (int map_lump_pos : wadfile.lumps_by_type(LT_MAP_HEADER))
 		{
 			if (wadfile.get_lump_subtype(map_lump_pos) == MF_UDMF)
 				continue;
 
 			bool hexen_format = wadfile.get_lump_subtype(map_lump_pos) == MF_HEXEN;
+			wadfile.load_map_block(map_lump_pos);
 
 			// Load SECTORS lump and prepare the modified one
 			int sectors_old_size = wadfile.get_lump_size(map_lump_pos + ML_SECTORS);
@@ -89,6 +115,8 @@ int main (int argc, char *argv[])
 				linedefs_num = linedefs_size / sizeof(linedef_hexen_t);
 				linedefs_hexen_data = (linedef_hexen_t *)wadfile.get_lump_data(map_lump_pos + ML_LINEDEFS);
 			}
+			// Linedefs are modified in place
+			wadfile.mark_lump_modified(map_lump_pos + ML_LINEDEFS);
 
 			if (arg_join_sectors)
 			{
@@ -174,7 +202,7 @@ int main (int argc, char *argv[])
 			}
 
 			// 2a) Process all sectors and join sectors with same properties
-			map<uint32_t, int> sectors_hash_map;
+			unordered_map<uint64_t, int> sectors_hash_map;
 			int *sector_remapping = new int[sectors_old_size];
 			for (int i = 0; i < sectors_old_num; i++)
 			{
@@ -189,11 +217,11 @@ int main (int argc, char *argv[])
 					total_rejected_sectors++;
 					continue;
 				}
-				uint32_t hash = compute_hash((uint8_t *)s, sizeof(sector_t));
+				uint64_t hash = compute_hash(s, sizeof(sector_t));
 				while (1)
 				{
 					// Find the hash in hash table. If collision is found, try next hash.
-					map<uint32_t, int>::iterator hash_it = sectors_hash_map.find(hash);
+					unordered_map<uint64_t, int>::iterator hash_it = sectors_hash_map.find(hash);
 					if (hash_it == sectors_hash_map.end())
 					{
 						// Hash not yet exists, create new entry and copy this sector
@@ -233,7 +261,7 @@ int main (int argc, char *argv[])
 			{
 
 			// 3a) Process all sidedefs and join sidedefs with same properties
-			map<uint32_t, int> sidedefs_hash_map;
+			unordered_map<uint64_t, int> sidedefs_hash_map;
 			int *sidedefs_remapping = new int[sidedefs_old_size];
 			for (int i = 0; i < sidedefs_old_num; i++)
 			{
@@ -245,11 +273,11 @@ int main (int argc, char *argv[])
 					s->yoff = 0;
 				}
 				// Check if sidedef with same properties already exists, if yes, perform remapping
-				uint32_t hash = compute_hash((uint8_t *)s, sizeof(sidedef_t));
+				uint64_t hash = compute_hash(s, sizeof(sidedef_t));
 				while (1)
 				{
 					// Find the hash in hash table. If collision is found, try next hash.
-					map<uint32_t, int>::iterator hash_it = sidedefs_hash_map.find(hash);
+					unordered_map<uint64_t, int>::iterator hash_it = sidedefs_hash_map.find(hash);
 					if (hash_it == sidedefs_hash_map.end())
 					{
 						// Hash not yet exists, create new entry and copy this sidedef
@@ -319,25 +347,37 @@ int main (int argc, char *argv[])
 			if (dropped_reject)
 				printf("Dropped Reject lump\n");
 			printf("\n");
+			wadfile.drop_map_block(map_lump_pos);
 		}
 		// Finally save the wad
-		if (!arg_dont_save_wad)
+		if (!arg_dont_save_wad && arg_update_wad)
+		{
+			// Only changed lumps are written at end of the file
+			wadfile.save_wad_file_incremental();
+		}
+		else if (!arg_dont_save_wad)
 		{
 			// Remove extension from filename
 			char *ext = strrchr(argv[n], '.');
 			if (strcmp(ext, ".wad") == 0 || strcmp(ext, ".WAD") == 0)
 				*ext = '\0';
-			wadfile.save_wad_file((string(argv[n]) + "_new.wad").c_str());
+			wadfile.save_wad_file((string(argv[n]) + "_new.wad").c_str(), true, save_options);
+			saved_bytes_dedup += wadfile.get_dedup_saved_bytes();
 		}
+		io_wait_time += wadfile.get_io_wait_time();
 	}
 	printf("----------------------------------\n");
 	printf("Totally joined: %6d sectors\n", joined_sectors);
 	printf("                %6d sidedefs\n", joined_sidedefs);
-	printf("Saved bytes: %7d total\n", saved_bytes_sectors + saved_bytes_sidedefs + saved_bytes_reject);
+	printf("Saved bytes: %7d total\n", saved_bytes_sectors + saved_bytes_sidedefs + saved_bytes_reject + saved_bytes_dedup);
 	printf("             %7d sectors\n", saved_bytes_sectors);
 	printf("             %7d sidedefs\n", saved_bytes_sidedefs);
 	printf("             %7d reject\n", saved_bytes_reject);
+	if (save_options.deduplicate)
+		printf("             %7d deduplicated lumps\n", saved_bytes_dedup);
 	printf("Sectors rejected from joining: %d\n", total_rejected_sectors);
+	if (arg_print_io_wait)
+		printf("Time waiting for reads: %.3f s\n", io_wait_time);
 	printf("----------------------------------\n");
 
 	return 0;
@@ -12,49 +12,48 @@ int main (int argc, char *argv[])
 	for (int n = 1; n < argc; n++)
 	{
 		WadFile wadfile;
-		if (!wadfile.load_wad_file(argv[n]))
+		if (!wadfile.load_wad_file(argv[n], false, LF_MMAP | LF_INDEX_CACHE))
 			continue;
 
 		// Process all map lumps
-		vector<wfLump> &lumps = wadfile.get_all_lumps();
-		int map_lump_pos;
-		while ((map_lump_pos = wadfile.find_next_lump_by_type(LT_MAP_HEADER)) != -1)
+		for (int map_lump_pos : wadfile.lumps_by_type(LT_MAP_HEADER))
 		{
-			bool hexen_format = lumps[map_lump_pos].subtype == MF_HEXEN;
-			bool scripts_present = hexen_format && (signed)lumps.size() > map_lump_pos + ML_SCRIPTS &&
-					lumps[map_lump_pos + ML_SCRIPTS].name == wfMapLumpTypeStr[ML_SCRIPTS];
+			bool hexen_format = wadfile.get_lump_subtype(map_lump_pos) == MF_HEXEN;
+			const char *scripts_name = wadfile.get_lump_name(map_lump_pos + ML_SCRIPTS);
+			bool scripts_present = hexen_format && scripts_name != NULL &&
+					strcmp(scripts_name, wfMapLumpTypeStr[ML_SCRIPTS]) == 0;
 			int count_up_to = hexen_format?(scripts_present?ML_SCRIPTS:ML_BEHAVIOR):ML_BLOCKMAP;
 			int total_size = 0;
 			for (int i = ML_THINGS; i <= count_up_to; i++)
 			{
-				total_size += lumps[map_lump_pos + i].size;
+				total_size += wadfile.get_lump_size(map_lump_pos + i);
 			}
-			printf("MAP %-8s (total %7d bytes)\n", lumps[map_lump_pos].name.c_str(), total_size);
+			printf("MAP %-8s (total %7d bytes)\n", wadfile.get_lump_name(map_lump_pos), total_size);
 			printf("----------------------------------\n");
-			int things_size = lumps[map_lump_pos + ML_THINGS].size;
+			int things_size = wadfile.get_lump_size(map_lump_pos + ML_THINGS);
 			int things_num = things_size / (hexen_format?sizeof(thing_hexen_t):sizeof(thing_doom_t));
 			printf("Things    %5d (%6d bytes)\n", things_num, things_size);
-			int linedefs_size = lumps[map_lump_pos + ML_LINEDEFS].size;
+			int linedefs_size = wadfile.get_lump_size(map_lump_pos + ML_LINEDEFS);
 			int linedefs_num = linedefs_size / (hexen_format?sizeof(linedef_hexen_t):sizeof(linedef_doom_t));
 			printf("Linedefs  %5d (%6d bytes)\n", linedefs_num, linedefs_size);
-			int sidedefs_size = lumps[map_lump_pos + ML_SIDEDEFS].size;
+			int sidedefs_size = wadfile.get_lump_size(map_lump_pos + ML_SIDEDEFS);
 			printf("Sidedefs  %5d (%6d bytes)\n", sidedefs_size / sizeof(sidedef_t), sidedefs_size);
-			int sectors_size = lumps[map_lump_pos + ML_SECTORS].size;
+			int sectors_size = wadfile.get_lump_size(map_lump_pos + ML_SECTORS);
 			printf("Sectors   %5d (%6d bytes)\n", sectors_size / sizeof(sector_t), sectors_size);
-			int vertexes_size = lumps[map_lump_pos + ML_VERTEXES].size;
+			int vertexes_size = wadfile.get_lump_size(map_lump_pos + ML_VERTEXES);
 			printf("Vertexes  %5d (%6d bytes)\n", vertexes_size / sizeof(vertex_t), vertexes_size);
-			int segs_size = lumps[map_lump_pos + ML_SEGS].size;
+			int segs_size = wadfile.get_lump_size(map_lump_pos + ML_SEGS);
 			printf("Segments  %5d (%6d bytes)\n", segs_size / sizeof(segment_t), segs_size);
-			int ssectors_size = lumps[map_lump_pos + ML_SSECTORS].size;
+			int ssectors_size = wadfile.get_lump_size(map_lump_pos + ML_SSECTORS);
 			printf("SSectors  %5d (%6d bytes)\n", ssectors_size / sizeof(subsector_t), ssectors_size);
-			int nodes_size = lumps[map_lump_pos + ML_NODES].size;
+			int nodes_size = wadfile.get_lump_size(map_lump_pos + ML_NODES);
 			printf("Nodes     %5d (%6d bytes)\n", nodes_size / sizeof(node_t), nodes_size);
-			printf("Reject          (%6d bytes)\n", lumps[map_lump_pos + ML_REJECT].size);
-			printf("Blockmap        (%6d bytes)\n", lumps[map_lump_pos + ML_BLOCKMAP].size);
+			printf("Reject          (%6d bytes)\n", wadfile.get_lump_size(map_lump_pos + ML_REJECT));
+			printf("Blockmap        (%6d bytes)\n", wadfile.get_lump_size(map_lump_pos + ML_BLOCKMAP));
 			if (hexen_format)
-				printf("Behavior        (%6d bytes)\n", lumps[map_lump_pos + ML_BEHAVIOR].size);
+				printf("Behavior        (%6d bytes)\n", wadfile.get_lump_size(map_lump_pos + ML_BEHAVIOR));
 			if (scripts_present)
-				printf("Scripts         (%6d bytes)\n", lumps[map_lump_pos + ML_SCRIPTS].size);
+				printf("Scripts         (%6d bytes)\n", wadfile.get_lump_size(map_lump_pos + ML_SCRIPTS));
 			printf("\n");
 		}
 	}
@@ -73,15 +73,15 @@ int main (int argc, char *argv[])
 	for (int n = optind; n < argc; n++)
 	{
 		WadFile wadfile;
-		if (!wadfile.load_wad_file(argv[n], true))
+		if (!wadfile.load_wad_file(argv[n], true, LF_MMAP))
 			continue;
 
 		// Process all map lumps
-		int map_lump_pos;
-		while ((map_lump_pos = wadfile.find_next_lump_by_type(LT_MAP_HEADER)) != -1)
+		for (int map_lump_pos : wadfile.lumps_by_type(LT_MAP_HEADER))
 		{
 			unsigned int lumpsize;
 			char *lump;
+			wadfile.load_map_block(map_lump_pos);
 
 			// Process SIDEDEFS lump
 			if (arg_linedef_textures)
@@ -113,6 +113,7 @@ int main (int argc, char *argv[])
 				}
 				wadfile.update_lump_data(map_lump_pos + ML_SECTORS);
 			}
+			wadfile.drop_map_block(map_lump_pos);
 		}
 	}
 }
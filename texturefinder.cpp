@@ -54,12 +54,13 @@ int main (int argc, char *argv[])
 	for (int n = optind; n < argc; n++)
 	{
 		WadFile wadfile;
-		if (!wadfile.load_wad_file(argv[n]))
+		if (!wadfile.load_wad_file(argv[n], false, LF_MMAP | LF_INDEX_CACHE))
 			continue;
+		// Only one lump is needed at a time
+		wadfile.set_lump_data_budget(16 << 20);
 
 		// Process all map lumps
-		int map_lump_pos;
-		while ((map_lump_pos = wadfile.find_next_lump_by_type(LT_MAP_HEADER)) != -1)
+		for (int map_lump_pos : wadfile.lumps_by_type(LT_MAP_HEADER))
 		{
 			// Cannot list textures for UDMF maps
 			if (wadfile.get_lump_subtype(map_lump_pos) == MF_UDMF)
@@ -67,6 +68,7 @@ int main (int argc, char *argv[])
 
 			unsigned int lumpsize;
 			char *lump;
+			wadfile.load_map_block(map_lump_pos);
 
 			// Process SIDEDEFS lump
 			if (arg_linedef_textures)
@@ -96,6 +98,7 @@ int main (int argc, char *argv[])
 					texture_names.insert(extract_name(sectors[j].ceiltex));
 				}
 			}
+			wadfile.drop_map_block(map_lump_pos);
 		}
 	}
 
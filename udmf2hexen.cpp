@@ -1,4 +1,5 @@
 #include <getopt.h>
+#include <unistd.h>
 #include <queue>
 
 #include "udmf2hexen_structs.h"
@@ -10,6 +11,16 @@
 // Auxiliary functions related to line ID and specials         //
 // *********************************************************** //
 
+// Check if more-properties structure has all fields unset
+bool is_zeroed(const void *data, int size)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	for (int i = 0; i < size; i++)
+		if (bytes[i])
+			return false;
+	return true;
+}
+
 bool backup_and_clear_line_special(linedef_hexen_t *line, linedef_more_props_indirect *mprops)
 {
 	int sp = line->special;
@@ -264,6 +275,8 @@ void print_help(const char* prog)
 	printf("Usage: %s [options] wadfile [wadfile ...]\n", prog);
 	printf(
 		"  -S: Do not save resulting wad, just print conversion log\n"
+		"  -o file: Name of resulting wad (only with single input wad)\n"
+		"           \"-\" writes the wad to standard output and log to error output\n"
 		"  -m name: Name of map to convert (all maps if not specified)\n"
 		"  -n: Rebuild nodes by running nodebuilder\n"
 		"  -N path: Nodebuilder path (default is \"zdbsp.exe\")\n"
@@ -277,6 +290,7 @@ void print_help(const char* prog)
 		"  -g flags: Global flags for texture-based conversion optimizations\n"
 		"  -f: Log floating-point values truncation problems\n"
 		"  -p: Log UDMF-specific properties of sectors and sidedefs\n"
+		"  -j threads: Number of threads writing resulting wad\n"
 		);
 }
 
@@ -293,6 +307,7 @@ int main (int argc, char *argv[])
 
 	// List of arguments
 	bool arg_dont_save_wad = false;
+	char *arg_output_filename = NULL;
 	char *arg_map_name = NULL;
 	bool arg_build_nodes = false;
 	bool arg_compile_scripts = false;
@@ -302,6 +317,7 @@ int main (int argc, char *argv[])
 	int  arg_global_texture_flags = 0;
 	bool arg_log_floating = false;
 	bool arg_print_properties = false;
+	wfSaveOptions save_options;
 	char *arg_nodebuilder_path = getenv("NODEBUILDER_PATH");
 	if (arg_nodebuilder_path == NULL)
 		arg_nodebuilder_path = (char *)"zdbsp.exe";
@@ -310,7 +326,7 @@ int main (int argc, char *argv[])
 		arg_acc_path = (char *)"acc.exe";
 	// Parse arguments
 	int c;
-	while ((c = getopt(argc, argv, "hSm:nN:cA:s:rtg:fp")) != -1)
+	while ((c = getopt(argc, argv, "hSo:m:nN:cA:s:rtg:fpj:")) != -1)
 	{
 		if (c == 'h')
 		{
@@ -319,6 +335,8 @@ int main (int argc, char *argv[])
 		}
 		else if (c == 'S')
 			arg_dont_save_wad = true;
+		else if (c == 'o')
+			arg_output_filename = optarg;
 		else if (c == 'm')
 			arg_map_name = optarg;
 		else if (c == 'n')
@@ -341,10 +359,31 @@ int main (int argc, char *argv[])
 			arg_log_floating = true;
 		else if (c == 'p')
 			arg_print_properties = true;
+		else if (c == 'j')
+			save_options.num_threads = atoi(optarg);
 		else
 			return 1;
 	}
 
+	if (arg_output_filename && argc - optind > 1)
+	{
+		fprintf(stderr, "Output filename can be given only for single wad.\n");
+		return 1;
+	}
+	// Keep standard output for the wad only, send all log into error output
+	bool output_to_stdout = arg_output_filename && strcmp(arg_output_filename, "-") == 0;
+	int wad_output_fd = -1;
+	if (output_to_stdout && arg_build_nodes)
+	{
+		fprintf(stderr, "Warning: Nodes cannot be rebuilt when writing the wad to standard output.\n");
+		arg_build_nodes = false;
+	}
+	if (output_to_stdout && !arg_dont_save_wad)
+	{
+		wad_output_fd = dup(fileno(stdout));
+		dup2(fileno(stderr), fileno(stdout));
+	}
+
 	// Check if given nodebuilder and acc paths are correct
 	if (arg_build_nodes)
 	{
@@ -428,8 +467,7 @@ int main (int argc, char *argv[])
 			continue;
 
 		// Process all map lumps
-		int map_lump_pos;
-		while ((map_lump_pos = wadfile.find_next_lump_by_type(LT_MAP_HEADER)) != -1)
+		for (int map_lump_pos : wadfile.lumps_by_type(LT_MAP_HEADER))
 		{
 			// Process only UDMF maps
 			if (wadfile.get_lump_subtype(map_lump_pos) != MF_UDMF)
@@ -444,12 +482,12 @@ int main (int argc, char *argv[])
 			// PART ZERO: Declare all variables for map conversion         //
 			// *********************************************************** //
 
-			// Binary map lumps
-			thing_hexen_t   *things   = (thing_hexen_t *)calloc(MAX_THINGS, sizeof(thing_hexen_t));
-			vertex_t        *vertexes = (vertex_t *)calloc(MAX_VERTEXES, sizeof(vertex_t));
-			linedef_hexen_t *linedefs = (linedef_hexen_t *)calloc(MAX_LINEDEFS, sizeof(linedef_hexen_t));
-			sidedef_t       *sidedefs = (sidedef_t *)calloc(MAX_SIDEDEFS, sizeof(sidedef_t));
-			sector_t        *sectors  = (sector_t *)calloc(MAX_SECTORS, sizeof(sector_t));
+			// Binary map lumps, owned by the wad file
+			thing_hexen_t   *things   = (thing_hexen_t *)wadfile.alloc_lump_buffer(MAX_THINGS * sizeof(thing_hexen_t));
+			vertex_t        *vertexes = (vertex_t *)wadfile.alloc_lump_buffer(MAX_VERTEXES * sizeof(vertex_t));
+			linedef_hexen_t *linedefs = (linedef_hexen_t *)wadfile.alloc_lump_buffer(MAX_LINEDEFS * sizeof(linedef_hexen_t));
+			sidedef_t       *sidedefs = (sidedef_t *)wadfile.alloc_lump_buffer(MAX_SIDEDEFS * sizeof(sidedef_t));
+			sector_t        *sectors  = (sector_t *)wadfile.alloc_lump_buffer(MAX_SECTORS * sizeof(sector_t));
 			// More UDMF properties
 			static vertex_more_props           vertexes_mprops      [MAX_VERTEXES];
 			static linedef_more_props_direct   linedefs_mprops_dir  [MAX_LINEDEFS];
@@ -843,9 +881,8 @@ int main (int argc, char *argv[])
 				linedef_more_props_indirect *mprops = &linedefs_mprops_indir[i];
 				if (line->lsidedef == 65535 || line->special != 0 || linedefs_mprops_dir[i].lineid != 0)
 					continue;
-				int hashfront = compute_hash((uint8_t *)&mprops->sides[SIDE_FRONT], sizeof(sidedef_more_props));
-				int hashback = compute_hash((uint8_t *)&mprops->sides[SIDE_BACK], sizeof(sidedef_more_props));
-				if (hashfront == 0 && hashback != 0)
+				if (is_zeroed(&mprops->sides[SIDE_FRONT], sizeof(sidedef_more_props)) &&
+					!is_zeroed(&mprops->sides[SIDE_BACK], sizeof(sidedef_more_props)))
 				{
 					// Flip linedef
 					memcpy(&mprops->sides[SIDE_FRONT], &mprops->sides[SIDE_BACK], sizeof(sidedef_more_props));
@@ -991,8 +1028,7 @@ int main (int argc, char *argv[])
 			{
 				sector_t *this_sector = &sectors[i];
 				sector_more_props *this_mprops = &sectors_mprops[i];
-				int hash = compute_hash((uint8_t *)this_mprops,  sizeof(sector_more_props));
-				if (this_sector->tag == 0 && hash == 0)
+				if (this_sector->tag == 0 && is_zeroed(this_mprops, sizeof(sector_more_props)))
 					continue;
 				TextureProperties *this_sector_floortex_props = GET_TXPROPS(this_sector->floortex);
 				TextureProperties *this_sector_ceiltex_props = GET_TXPROPS(this_sector->ceiltex);
@@ -1166,16 +1202,16 @@ int main (int argc, char *argv[])
 			int affected_linedef_count = 0;
 
 			// Second find all linedefs with same specials and assign them tags
-			map<uint32_t, int> linedefs_mprops_hash_map;
+			unordered_map<uint64_t, int> linedefs_mprops_hash_map;
 			map<int, int> lineid_to_linenum_map;
 			for (int i = 0; i < num_linedefs; i++)
 			{
 				// Check if linedef has any more-properties.
 				linedef_hexen_t *line = &linedefs[i];
 				linedef_more_props_indirect *lm = &linedefs_mprops_indir[i];
-				uint32_t hash = compute_hash((uint8_t *)lm, sizeof(linedef_more_props_indirect));
-				if (hash == 0)
+				if (is_zeroed(lm, sizeof(linedef_more_props_indirect)))
 					continue;
+				uint64_t hash = compute_hash(lm, sizeof(linedef_more_props_indirect));
 				int lineid = get_line_id(line); //linedefs_mprops_dir[i].lineid;
 				if (lineid > 0)
 				{
@@ -1196,7 +1232,7 @@ int main (int argc, char *argv[])
 				while (1)
 				{
 					// Find the hash in hash table. If collision is found, try next hash.
-					map<uint32_t, int>::iterator hash_it = linedefs_mprops_hash_map.find(hash);
+					unordered_map<uint64_t, int>::iterator hash_it = linedefs_mprops_hash_map.find(hash);
 					if (hash_it == linedefs_mprops_hash_map.end())
 					{
 						// Hash not yet exists, create new id for this linedef
@@ -1286,7 +1322,7 @@ int main (int argc, char *argv[])
 			int affected_sector_count = 0;
 
 			// Second find all sectors with same-properties and assign them tags
-			map<uint32_t, int> sectors_mprops_hash_map;
+			unordered_map<uint64_t, int> sectors_mprops_hash_map;
 			map<int, int> tag_to_secnum_map;
 			map<int, vector<int> > new_assigned_tags;
 			for (int i = 0; i < num_sectors; i++)
@@ -1327,15 +1363,15 @@ int main (int argc, char *argv[])
 					mprops->original_tag = tag; // Backup original tag
 				}
 				// Check for sector more-properties
-				uint32_t hash = compute_hash((uint8_t *)mprops, sizeof(sector_more_props));
-				if (hash == 0)
+				if (is_zeroed(mprops, sizeof(sector_more_props)))
 					continue;
+				uint64_t hash = compute_hash(mprops, sizeof(sector_more_props));
 				// If sector has zero tag (or conflict was found), we will give it new tag.
 				// If any sector with same properties already exists, give current sector same tag.
 				while (1)
 				{
 					// Find the hash in hash table. If collision is found, try next hash.
-					map<uint32_t, int>::iterator hash_it = sectors_mprops_hash_map.find(hash);
+					unordered_map<uint64_t, int>::iterator hash_it = sectors_mprops_hash_map.find(hash);
 					if (hash_it == sectors_mprops_hash_map.end())
 					{
 						// Hash not yet exists, create new tag for this sector
@@ -1432,7 +1468,7 @@ int main (int argc, char *argv[])
 			int affected_thing_count = 0;
 
 			// Second find all things with same-properties and assign them IDs
-			map<uint32_t, int> things_mprops_hash_map;
+			unordered_map<uint64_t, int> things_mprops_hash_map;
 			map<int, int> tid_to_thingnum_map;
 			for (int i = 0; i < num_things; i++)
 			{
@@ -1457,15 +1493,15 @@ int main (int argc, char *argv[])
 					continue;
 				}
 				// Check for thing more-properties
-				uint32_t hash = compute_hash((uint8_t *)mprops, sizeof(thing_more_props));
-				if (hash == 0)
+				if (is_zeroed(mprops, sizeof(thing_more_props)))
 					continue;
+				uint64_t hash = compute_hash(mprops, sizeof(thing_more_props));
 				// If thing has zero tid we will give it new tid.
 				// If any thing with same properties already exists, give current thing same tid.
 				while (1)
 				{
 					// Find the hash in hash table. If collision is found, try next hash.
-					map<uint32_t, int>::iterator hash_it = things_mprops_hash_map.find(hash);
+					unordered_map<uint64_t, int>::iterator hash_it = things_mprops_hash_map.find(hash);
 					if (hash_it == things_mprops_hash_map.end())
 					{
 						// Hash not yet exists, create new tid for this thing
@@ -1726,7 +1762,8 @@ int main (int argc, char *argv[])
 				lump_name = wadfile.get_lump_name(lump_pos);
 				if (strcmp(lump_name, "BEHAVIOR") == 0)
 				{
-					behavior_data = wadfile.get_lump_data(lump_pos);
+					// BEHAVIOR lump is appended again with the same data
+					behavior_data = wadfile.share_lump_data(lump_pos);
 					behavior_size = wadfile.get_lump_size(lump_pos);
 					wadfile.delete_lump(lump_pos, false);
 					behavior_lump_pos = lump_pos;
@@ -1745,7 +1782,7 @@ int main (int argc, char *argv[])
 
 
 			// *** PART 5b: Construct contents of SCRIPTS lump
-			char *final_script = (char *)calloc(SCRIPT_SIZE * 2, 1);
+			char *final_script = wadfile.alloc_lump_buffer(SCRIPT_SIZE * 2);
 			char *final_script_work = final_script;
 
 			// Copy contents of original SCRIPTS lump
@@ -1797,7 +1834,7 @@ int main (int argc, char *argv[])
 					behavior_size = ftell(tmpacs);
 					fseek(tmpacs, 0, SEEK_SET);
 					wadfile.drop_lump_data(behavior_lump_pos);
-					behavior_data = (char *)malloc(behavior_size);
+					behavior_data = wadfile.alloc_lump_buffer(behavior_size);
 					fread(behavior_data, 1, behavior_size, tmpacs);
 					fclose(tmpacs);
 					unlink("tmp.acs");
@@ -1835,12 +1872,21 @@ int main (int argc, char *argv[])
 		// Finally save the wad
 		// Remove extension from filename
 		char *ext = strrchr(argv[n], '.');
-		if (stricmp(ext, ".wad") == 0)
+		if (ext && (stricmp(ext, ".wad") == 0 || stricmp(ext, ".pk3") == 0))
 			*ext = '\0';
 		string result_filename = string(argv[n]) + "_hexen.wad";
+		if (arg_output_filename)
+			result_filename = arg_output_filename;
+		if (wad_output_fd != -1)
+		{
+			// Restore standard output for writing the wad
+			fflush(stdout);
+			dup2(wad_output_fd, fileno(stdout));
+			close(wad_output_fd);
+		}
 		if (arg_build_nodes)
 		{
-			wadfile.save_wad_file("tmp.wad");
+			wadfile.save_wad_file("tmp.wad", true, save_options);
 			char cmd[256];
 			char mapname[16] = {0};
 			if (arg_map_name)
@@ -1850,7 +1896,7 @@ int main (int argc, char *argv[])
 		}
 		else
 		{
-			wadfile.save_wad_file(result_filename.c_str());
+			wadfile.save_wad_file(result_filename.c_str(), true, save_options);
 		}
 	}
 	return 0;
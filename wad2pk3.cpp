@@ -0,0 +1,38 @@
+#include "wad_file.h"
+#include <getopt.h>
+#include <thread>
+
+int main (int argc, char *argv[])
+{
+	if (argc < 3)
+	{
+		printf("Usage: %s [-j threads] wadfile pk3file\n", argv[0]);
+		printf("  Converts wad (or pk3) file into pk3 file\n");
+		printf("  -j threads: Number of threads compressing the files (default: all cores)\n");
+		return 1;
+	}
+
+	// Parse arguments
+	wfSaveOptions save_options;
+	save_options.num_threads = thread::hardware_concurrency();
+	int c;
+	while ((c = getopt(argc, argv, "j:")) != -1)
+	{
+		if (c == 'j')
+			save_options.num_threads = atoi(optarg);
+		else
+			return 1;
+	}
+	if (argc - optind != 2)
+	{
+		fprintf(stderr, "You must specify input and output filename.\n");
+		return 1;
+	}
+
+	WadFile wadfile;
+	if (!wadfile.load_wad_file(argv[optind], false, LF_MMAP))
+		return 2;
+	if (!wadfile.save_pk3_file(argv[optind + 1], true, save_options))
+		return 2;
+	return 0;
+}
@@ -0,0 +1,83 @@
+#include "wad_collection.h"
+
+// Namespace of lumps of each type, -1 if lumps of the type are not indexed
+static const int wcLumpTypeNamespace[] =
+{
+	NS_GLOBAL,   // LT_UNKNOWN
+	NS_MAPS,     // LT_MAP_HEADER
+	-1,          // LT_MAP_LUMP
+	-1,          // LT_MISC_MARKER
+	NS_GLOBAL,   // LT_MISC_PNAMES
+	NS_GLOBAL,   // LT_MISC_TEXTURES
+	NS_SPRITES,  // LT_IMAGE_SPRITE
+	NS_TEXTURES, // LT_IMAGE_TEXTURE
+	NS_PATCHES,  // LT_IMAGE_PATCH
+	NS_FLATS     // LT_IMAGE_FLAT
+};
+
+WadCollection::~WadCollection()
+{
+	close_all();
+}
+
+bool WadCollection::add_wad_file(const char *filename, int flags)
+{
+	WadFile *wadfile = new WadFile();
+	if (!wadfile->load_wad_file(filename, false, flags))
+	{
+		delete wadfile;
+		return false;
+	}
+	wad_files.push_back(wadfile);
+	wad_filenames.push_back(filename);
+	index_wad_file(wad_files.size() - 1);
+	return true;
+}
+
+void WadCollection::close_all()
+{
+	for (unsigned int i = 0; i < wad_files.size(); i++)
+		delete wad_files[i];
+	wad_files.clear();
+	wad_filenames.clear();
+	for (int ns = 0; ns < NS_COUNT; ns++)
+		lump_index[ns].clear();
+}
+
+void WadCollection::index_wad_file(int wad_index)
+{
+	WadFile *wadfile = wad_files[wad_index];
+	int num_lumps = wadfile->get_num_lumps();
+	// Lumps belonging to maps are reached only through their map header
+	const vector<wfLumpRange> &maps = wadfile->get_lump_ranges(LT_MAP_HEADER);
+	unsigned int m = 0;
+	for (int i = 0; i < num_lumps; i++)
+	{
+		while (m < maps.size() && maps[m].end <= i)
+			m++;
+		if (m < maps.size() && i > maps[m].start && i < maps[m].end)
+			continue;
+		int ns = wcLumpTypeNamespace[wadfile->get_lump_type(i)];
+		if (ns == -1)
+			continue;
+		wcLumpRef ref = {wad_index, i};
+		lump_index[ns][pack_name(wadfile->get_lump_name(i))] = ref;
+	}
+}
+
+wcLumpRef WadCollection::find_lump(const string &name, int ns) const
+{
+	// Names longer than 8 characters never match
+	if (name.size() > 8)
+	{
+		wcLumpRef none = {-1, -1};
+		return none;
+	}
+	unordered_map<uint64_t, wcLumpRef>::const_iterator it = lump_index[ns].find(pack_name(name.c_str()));
+	if (it == lump_index[ns].end())
+	{
+		wcLumpRef none = {-1, -1};
+		return none;
+	}
+	return it->second;
+}
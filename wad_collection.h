@@ -0,0 +1,72 @@
+#ifndef WAD_COLLECTION_H
+#define WAD_COLLECTION_H
+
+#include "wad_file.h"
+
+// *********************************************************** //
+// Namespaces where lumps override each other                  //
+// *********************************************************** //
+
+enum wcNamespace
+{
+	NS_GLOBAL = 0,
+	NS_MAPS,
+	NS_SPRITES,
+	NS_TEXTURES,
+	NS_PATCHES,
+	NS_FLATS,
+	NS_COUNT
+};
+
+// Lump within the collection: index of wad file and position in it
+struct wcLumpRef
+{
+	int wad_index;
+	int lump_pos;
+
+	bool is_valid() const {return wad_index != -1;}
+};
+
+// *********************************************************** //
+// WadCollection class                                         //
+// *********************************************************** //
+
+// Stack of wad files loaded in order (i.e. IWAD followed by PWADs), with
+// one merged index of effective lumps. Lumps in later wads override lumps
+// of the same name and namespace in earlier ones, and whole maps override
+// maps of the same name. Within one wad the last lump of a name wins.
+class WadCollection
+{
+private:
+	vector<WadFile *> wad_files;
+	vector<string> wad_filenames;
+	// Effective lump for each packed lump name, per namespace
+	unordered_map<uint64_t, wcLumpRef> lump_index[NS_COUNT];
+
+	void index_wad_file(int wad_index);
+
+public:
+	WadCollection() {};
+
+	~WadCollection();
+
+	bool add_wad_file(const char *filename, int flags = 0);
+	void close_all();
+
+	int get_num_wads() const {return wad_files.size();}
+	WadFile *get_wad_file(int wad_index) {return wad_files[wad_index];}
+	const char *get_wad_filename(int wad_index) const {return wad_filenames[wad_index].c_str();}
+
+	// Effective lump of given name in namespace, invalid reference if there is none
+	wcLumpRef find_lump(const string &name, int ns = NS_GLOBAL) const;
+	// Effective map header lump. Map lumps follow it in the same wad.
+	wcLumpRef find_map(const string &name) const {return find_lump(name, NS_MAPS);}
+	// All effective lumps of namespace, by packed lump name
+	const unordered_map<uint64_t, wcLumpRef> &get_namespace_lumps(int ns) const {return lump_index[ns];}
+
+	const char *get_lump_name(wcLumpRef ref) const {return wad_files[ref.wad_index]->get_lump_name(ref.lump_pos);}
+	int get_lump_size(wcLumpRef ref) const {return wad_files[ref.wad_index]->get_lump_size(ref.lump_pos);}
+	char *get_lump_data(wcLumpRef ref) {return wad_files[ref.wad_index]->get_lump_data(ref.lump_pos);}
+};
+
+#endif // WAD_COLLECTION_H
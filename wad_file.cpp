@@ -1,4 +1,132 @@
 #include "wad_file.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifdef _WIN32
+#include <io.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#ifdef _WIN32
+// Emulation of positional read and write. Unlike the POSIX functions
+// these move the file offset, so they are not safe to use concurrently.
+static int pread(int fd, void *buf, size_t count, int64_t offset)
+{
+	if (_lseeki64(fd, offset, SEEK_SET) != offset)
+		return -1;
+	return _read(fd, buf, count);
+}
+
+static int pwrite(int fd, const void *buf, size_t count, int64_t offset)
+{
+	if (_lseeki64(fd, offset, SEEK_SET) != offset)
+		return -1;
+	return _write(fd, buf, count);
+}
+#endif
+
+// *********************************************************** //
+// Low-level file I/O                                          //
+// *********************************************************** //
+
+// Write data at given position of file, or at current position if pos is -1
+bool write_all(int fd, const char *data, size_t size, int64_t pos)
+{
+	while (size > 0)
+	{
+		int write_cnt = (pos == -1) ? write(fd, data, size) : pwrite(fd, data, size, pos);
+		if (write_cnt <= 0)
+			return false;
+		data += write_cnt;
+		size -= write_cnt;
+		if (pos != -1)
+			pos += write_cnt;
+	}
+	return true;
+}
+
+// Size of virtual memory page, used for mapped file access
+static uint32_t get_page_size()
+{
+#ifndef _WIN32
+	static const uint32_t page_size = sysconf(_SC_PAGESIZE);
+	return page_size;
+#else
+	return 4096;
+#endif
+}
+
+// Write given number of zero bytes at current position of file
+static bool write_zeros(int fd, size_t size)
+{
+	static const char zeros[4096] = {0};
+	while (size > 0)
+	{
+		size_t chunk = min(size, sizeof(zeros));
+		if (!write_all(fd, zeros, chunk))
+			return false;
+		size -= chunk;
+	}
+	return true;
+}
+
+// Copy part of source file to target file at given position (or current
+// position if dst_pos is -1). Where possible the data are copied inside
+// the kernel, without passing through user space.
+bool copy_file_data(int src_fd, int64_t src_pos, int dst_fd, int64_t dst_pos, size_t size)
+{
+#ifdef __linux__
+	loff_t in_pos = src_pos;
+	loff_t out_pos = dst_pos;
+	while (size > 0)
+	{
+		int copied = copy_file_range(src_fd, &in_pos, dst_fd, (dst_pos == -1) ? NULL : &out_pos, size, 0);
+		if (copied <= 0)
+			break;
+		size -= copied;
+	}
+	// copy_file_range is not supported between all file systems, try sendfile
+	// (it can write only to current position of target file)
+	while (size > 0 && dst_pos == -1)
+	{
+		off_t sendfile_pos = in_pos;
+		int copied = sendfile(dst_fd, src_fd, &sendfile_pos, size);
+		if (copied <= 0)
+			break;
+		in_pos = sendfile_pos;
+		size -= copied;
+	}
+	src_pos = in_pos;
+	if (dst_pos != -1)
+		dst_pos = out_pos;
+#endif
+	// Fall back to plain read and write
+	char buffer[65536];
+	while (size > 0)
+	{
+		int read_cnt = pread(src_fd, buffer, min(size, sizeof(buffer)), src_pos);
+		if (read_cnt <= 0 || !write_all(dst_fd, buffer, read_cnt, dst_pos))
+			return false;
+		src_pos += read_cnt;
+		if (dst_pos != -1)
+			dst_pos += read_cnt;
+		size -= read_cnt;
+	}
+	return true;
+}
 
 // *********************************************************** //
 // Wad lump types and definitions                              //
@@ -26,67 +154,364 @@ const char *wfMapLumpTypeStr[] = {
 
 WadFile::~WadFile()
 {
-	if (source_file)
-		fclose(source_file);
-	for (unsigned int i = 0; i < lumps.size(); i++)
+	close_wad_file();
+}
+
+void WadFile::close_wad_file()
+{
+	if (source_fd != -1)
+		close(source_fd);
+	source_fd = -1;
+	for (unsigned int i = 0; i < lump_data.size(); i++)
 	{
-		if (lumps[i].data != NULL && !lumps[i].dont_free)
-			free(lumps[i].data);
+		if (lump_data[i] != NULL && !(lump_flags[i] & LS_NOT_OWNED))
+			free(lump_data[i]);
 	}
+	for (map<int, char *>::iterator it = map_blocks.begin(); it != map_blocks.end(); it++)
+		free(it->second);
+	map_blocks.clear();
+	cached_lumps.clear();
+	cached_lump_pos.clear();
+	cached_data_size = 0;
+	for (set<char *>::iterator it = arena_chunks.begin(); it != arena_chunks.end(); it++)
+		free(*it);
+	arena_chunks.clear();
+	arena_last_chunk = NULL;
+	arena_chunk_used = 0;
+	for (unordered_map<char *, int>::iterator it = shared_buffers.begin(); it != shared_buffers.end(); it++)
+		free(it->first);
+	shared_buffers.clear();
+	for (unsigned int i = 0; i < nested_wads.size(); i++)
+		free(nested_wads[i].data);
+	nested_wads.clear();
+	packed_lumps.clear();
+	is_pk3 = false;
+	is_iwad = false;
+#ifndef _WIN32
+	if (mapping)
+		munmap(mapping, mapping_size);
+#endif
+	mapping = NULL;
+	mapping_size = 0;
+	lump_names.clear();
+	lump_name_strs.clear();
+	lump_file_pos.clear();
+	lump_sizes.clear();
+	lump_data.clear();
+	lump_types.clear();
+	lump_subtypes.clear();
+	lump_flags.clear();
+	for (int t = 0; t < WF_NUM_LUMP_TYPES; t++)
+		lump_ranges[t].clear();
+	name_slots.clear();
+	num_names = 0;
+	next_same_name.clear();
+	reset_cursor();
 }
 
-#define IF_MARKER(markname, flag, val) else if(lump.name == markname) {lumps[i].type = LT_MISC_MARKER; flag+=val;}
+// *********************************************************** //
+// Lump type detection tables                                  //
+// *********************************************************** //
+
+// Namespace markers: lump type of namespace and whether marker starts or ends it
+struct wfMarker
+{
+	const char *name;
+	int type;
+	int delta;
+};
 
-bool WadFile::load_wad_file(const char* filename, bool update)
+static const wfMarker wfMarkers[] =
+{
+	{"S_START", LT_IMAGE_SPRITE, 1},
+	{"S_END", LT_IMAGE_SPRITE, -1},
+	{"TX_START", LT_IMAGE_TEXTURE, 1},
+	{"TX_END", LT_IMAGE_TEXTURE, -1},
+	{"P_START", LT_IMAGE_PATCH, 1},
+	{"P1_START", LT_IMAGE_PATCH, 1},
+	{"P2_START", LT_IMAGE_PATCH, 1},
+	{"P3_START", LT_IMAGE_PATCH, 1},
+	{"PP_START", LT_IMAGE_PATCH, 1},
+	{"P_END", LT_IMAGE_PATCH, -1},
+	{"P1_END", LT_IMAGE_PATCH, -1},
+	{"P2_END", LT_IMAGE_PATCH, -1},
+	{"P3_END", LT_IMAGE_PATCH, -1},
+	{"PP_END", LT_IMAGE_PATCH, -1},
+	{"F_START", LT_IMAGE_FLAT, 1},
+	{"F1_START", LT_IMAGE_FLAT, 1},
+	{"F2_START", LT_IMAGE_FLAT, 1},
+	{"F3_START", LT_IMAGE_FLAT, 1},
+	{"FF_START", LT_IMAGE_FLAT, 1},
+	{"F_END", LT_IMAGE_FLAT, -1},
+	{"F1_END", LT_IMAGE_FLAT, -1},
+	{"F2_END", LT_IMAGE_FLAT, -1},
+	{"F3_END", LT_IMAGE_FLAT, -1},
+	{"FF_END", LT_IMAGE_FLAT, -1},
+	{NULL, 0, 0}
+};
+
+// Markers by packed name
+static unordered_map<uint64_t, const wfMarker *> build_marker_index()
+{
+	unordered_map<uint64_t, const wfMarker *> index;
+	for (int i = 0; wfMarkers[i].name; i++)
+		index[pack_name(wfMarkers[i].name)] = &wfMarkers[i];
+	return index;
+}
+
+static const wfMarker *find_marker(uint64_t name)
+{
+	static const unordered_map<uint64_t, const wfMarker *> index = build_marker_index();
+	unordered_map<uint64_t, const wfMarker *>::const_iterator it = index.find(name);
+	return (it == index.end()) ? NULL : it->second;
+}
+
+// Names of lumps which may follow map header
+static bool is_map_lump_name(uint64_t name)
+{
+	static const char *names[] = {"THINGS", "LINEDEFS", "SIDEDEFS", "VERTEXES", "SEGS", "SSECTORS", "NODES",
+		"SECTORS", "REJECT", "BLOCKMAP", "BEHAVIOR", "SCRIPTS", "TEXTMAP", "ZNODES", "DIALOGUE", "ENDMAP", NULL};
+	for (int i = 0; names[i]; i++)
+		if (name == pack_name(names[i]))
+			return true;
+	return false;
+}
+
+// Add lump to ranges of its type, lumps must be added in directory order.
+// Each map header starts a new range.
+void WadFile::add_lump_range(int type, int lump_pos)
+{
+	vector<wfLumpRange> &ranges = lump_ranges[type];
+	if (type != LT_MAP_HEADER && !ranges.empty() && ranges.back().end == lump_pos)
+		ranges.back().end++;
+	else
+	{
+		wfLumpRange range = {lump_pos, lump_pos + 1};
+		ranges.push_back(range);
+	}
+}
+
+const vector<wfLumpRange> &WadFile::get_lump_ranges(int type) const
+{
+	static const vector<wfLumpRange> no_ranges;
+	if (type < 0 || type >= WF_NUM_LUMP_TYPES)
+		return no_ranges;
+	return lump_ranges[type];
+}
+
+
+bool WadFile::load_wad_file(const char* filename, bool update, int flags)
 {
 	// Open wad file
-	source_file = fopen(filename, update?"r+b":"rb");
+	close_wad_file();
+	source_fd = open(filename, (update?O_RDWR:O_RDONLY) | O_BINARY);
+	source_filename = filename;
 	update_mode = update;
-	if (source_file == NULL)
+	load_flags = flags;
+	if (source_fd == -1)
 	{
 		fprintf(stderr, "Failed to open wad file %s\n",filename);
 		return false;
 	}
 	// Read wad header
 	wadinfo_t header;
-	int read_cnt = fread(&header, sizeof(wadinfo_t), 1, source_file);
-	if (read_cnt != 1 || (strncmp(header.identification, "PWAD", 4) && strncmp(header.identification, "IWAD", 4)))
+	int read_cnt = pread(source_fd, &header, sizeof(wadinfo_t), 0);
+	is_pk3 = read_cnt == sizeof(wadinfo_t) && memcmp(header.identification, "PK\3\4", 4) == 0;
+	if (read_cnt != sizeof(wadinfo_t) || (!is_pk3 && strncmp(header.identification, "PWAD", 4) && strncmp(header.identification, "IWAD", 4)))
 	{
 		// Print error only for files with .wad extension
 		if (strstr(filename, ".wad") || strstr(filename, ".WAD"))
 			fprintf(stderr, "File %s is not a valid wad file.\n",filename);
 		return false;
 	}
+	is_iwad = strncmp(header.identification, "IWAD", 4) == 0;
+	if (is_pk3 && update)
+	{
+		fprintf(stderr, "Cannot update pk3 file %s\n",filename);
+		return false;
+	}
+#ifndef _WIN32
+	// Map whole file into memory. If mapping fails, lumps are read from file as usual.
+	struct stat st;
+	if ((flags & LF_MMAP) && fstat(source_fd, &st) == 0 && st.st_size > 0)
+	{
+		void *addr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, source_fd, 0);
+		if (addr != MAP_FAILED)
+		{
+			mapping = (char *)addr;
+			mapping_size = st.st_size;
+		}
+	}
+#endif
+	// Read central directory of pk3 file
+	if (is_pk3)
+	{
+		if (!read_pk3_directory())
+		{
+			fprintf(stderr, "File %s is not a valid pk3 file.\n",filename);
+			return false;
+		}
+	}
+	// Read lump directory and detect lump types, unless they are cached
+	else if (!(flags & LF_INDEX_CACHE) || !load_index_cache(header))
+	{
+		if (!read_lump_directory(header))
+		{
+			fprintf(stderr, "File %s is truncated or has invalid lump directory.\n",filename);
+			return false;
+		}
+		detect_lump_types();
+		if (flags & LF_INDEX_CACHE)
+			save_index_cache(header);
+	}
+	reset_cursor();
+	return true;
+}
+
+void WadFile::resize_lump_directory(int num_lumps)
+{
+	// One allocation per column
+	lump_names.assign(num_lumps, 0);
+	lump_name_strs.assign(num_lumps, wfLumpName());
+	lump_file_pos.assign(num_lumps, 0);
+	lump_sizes.assign(num_lumps, 0);
+	lump_data.assign(num_lumps, NULL);
+	lump_types.assign(num_lumps, LT_UNKNOWN);
+	lump_subtypes.assign(num_lumps, 0);
+	lump_flags.assign(num_lumps, 0);
+	for (int t = 0; t < WF_NUM_LUMP_TYPES; t++)
+		lump_ranges[t].clear();
+}
+
+void WadFile::index_lump_names()
+{
+	// At least twice as many slots as lumps, so the table does not grow meanwhile
+	unsigned int num_slots = 16;
+	while (num_slots < lump_names.size() * 2)
+		num_slots *= 2;
+	wfNameSlot empty_slot = {-1, -1};
+	name_slots.assign(num_slots, empty_slot);
+	num_names = 0;
+	next_same_name.assign(lump_names.size(), -1);
+	for (unsigned int i = 0; i < lump_names.size(); i++)
+	{
+		memcpy(lump_name_strs[i].str, &lump_names[i], 8);
+		add_name_index(i);
+	}
+}
+
+void WadFile::add_name_index(int lump_pos)
+{
+	// Keep the table at most half full
+	if ((unsigned int)(num_names + 1) * 2 > name_slots.size())
+	{
+		vector<wfNameSlot> old_slots;
+		old_slots.swap(name_slots);
+		wfNameSlot empty_slot = {-1, -1};
+		name_slots.assign(max(old_slots.size() * 2, (size_t)16), empty_slot);
+		for (unsigned int s = 0; s < old_slots.size(); s++)
+			if (old_slots[s].first != -1)
+				name_slots[find_name_slot(lump_names[old_slots[s].first])] = old_slots[s];
+	}
+	wfNameSlot &slot = name_slots[find_name_slot(lump_names[lump_pos])];
+	next_same_name[lump_pos] = -1;
+	if (slot.first == -1)
+	{
+		slot.first = lump_pos;
+		num_names++;
+	}
+	else
+		next_same_name[slot.last] = lump_pos;
+	slot.last = lump_pos;
+}
+
+// Slot holding given name, or empty slot where it belongs
+unsigned int WadFile::find_name_slot(uint64_t name) const
+{
+	unsigned int mask = name_slots.size() - 1;
+	unsigned int s = (name * 0x9E3779B97F4A7C15ULL) >> 32 & mask;
+	while (name_slots[s].first != -1 && lump_names[name_slots[s].first] != name)
+		s = (s + 1) & mask;
+	return s;
+}
+
+const wfNameSlot *WadFile::find_name(uint64_t name) const
+{
+	if (name_slots.empty())
+		return NULL;
+	const wfNameSlot &slot = name_slots[find_name_slot(name)];
+	return (slot.first == -1) ? NULL : &slot;
+}
+
+bool WadFile::read_lump_directory(const wadinfo_t &header)
+{
+	// Directory must lie within the file
+	struct stat st;
+	if (fstat(source_fd, &st) != 0)
+		return false;
+	uint64_t file_size = st.st_size;
+	uint64_t directory_size = (uint64_t)sizeof(filelump_t) * header.numnlumps;
+	if ((uint64_t)header.infotableofs + directory_size > file_size)
+		return false;
 	// Read lump names and pointers
-	fseek(source_file, header.infotableofs, SEEK_SET);
-	filelump_t *lump_directory = (filelump_t *)malloc(sizeof(filelump_t) * header.numnlumps);
-	fread(lump_directory, sizeof(filelump_t), header.numnlumps, source_file);
-	lumps.clear();
-	lumps.resize(header.numnlumps);
+	filelump_t *lump_directory = (filelump_t *)malloc(directory_size + 1);
+	if (lump_directory == NULL || read_source((char *)lump_directory, directory_size, header.infotableofs) != (int64_t)directory_size)
+	{
+		free(lump_directory);
+		return false;
+	}
+	// Check that data of all lumps lie within the file, after the header.
+	// Empty lumps (markers) may point anywhere. The loop has no branches,
+	// so that it can be vectorized.
+	int num_lumps = header.numnlumps;
+	uint64_t max_end = 0;
+	uint32_t min_start = 0xFFFFFFFF;
+	for (int i = 0; i < num_lumps; i++)
+	{
+		uint64_t has_data = lump_directory[i].size != 0;
+		max_end = max(max_end, ((uint64_t)lump_directory[i].filepos + lump_directory[i].size) * has_data);
+		min_start = min(min_start, has_data ? lump_directory[i].filepos : 0xFFFFFFFF);
+	}
+	if (max_end > file_size || min_start < sizeof(wadinfo_t))
+	{
+		free(lump_directory);
+		return false;
+	}
+	resize_lump_directory(num_lumps);
+	for (int i = 0; i < num_lumps; i++)
+	{
+		lump_names[i] = pack_name(lump_directory[i].name);
+		lump_file_pos[i] = lump_directory[i].filepos;
+		lump_sizes[i] = lump_directory[i].size;
+	}
+	free(lump_directory);
+	index_lump_names();
+	return true;
+}
+
+void WadFile::detect_lump_types()
+{
+	int num_lumps = lump_names.size();
 	// Auxiliary variables for detecting lump types
+	uint64_t map_lump_names[ML_SCRIPTS + 1];
+	for (int i = 0; i <= ML_SCRIPTS; i++)
+		map_lump_names[i] = pack_name(wfMapLumpTypeStr[i]);
+	const uint64_t textmap_name = pack_name("TEXTMAP");
+	const uint64_t texture1_name = pack_name("TEXTURE1");
+	const uint64_t texture2_name = pack_name("TEXTURE2");
 	int map_start_pos = -1;
-	int inside_sprites = 0;
-	int inside_textures = 0;
-	int inside_patches = 0;
-	int inside_flats = 0;
+	const wfMarker *marker;
+	// Nesting level of namespace markers, by lump type of namespace
+	int inside[WF_NUM_LUMP_TYPES] = {0};
 	// Process all lumps and detect their types
-	for (unsigned int i = 0; i < header.numnlumps; i++)
-	{
-		// Set lump properties
-		wfLump &lump = lumps[i];
-		lump.name = extract_name(lump_directory[i].name);
-		lump.source_file_pos = lump_directory[i].filepos;
-		lump.size = lump_directory[i].size;
-		lump.data = NULL;
-		lump.type = LT_UNKNOWN;
-		lump.subtype = 0;
-		lump.deleted = false;
-		lump.dont_free = false;
+	for (int i = 0; i < num_lumps; i++)
+	{
+		uint64_t name = lump_names[i];
 		// Detect map header lump
 		if (map_start_pos != -1)
 		{
 			// If any lump out-of-map-lumps-order found, reject map header
-			if (lump.name != wfMapLumpTypeStr[i - map_start_pos])
+			if (name != map_lump_names[i - map_start_pos])
 			{
 				map_start_pos = -1;
 				i--;
@@ -95,144 +520,586 @@ bool WadFile::load_wad_file(const char* filename, bool update)
 			// If processed all lumps up to BLOCKMAP, we successfully detected a map
 			else if (i - map_start_pos == ML_BLOCKMAP)
 			{
-				lumps[map_start_pos].type = LT_MAP_HEADER;
-				lumps[map_start_pos].subtype = MF_DOOM;
+				lump_types[map_start_pos] = LT_MAP_HEADER;
+				lump_subtypes[map_start_pos] = MF_DOOM;
+				add_lump_range(LT_MAP_HEADER, map_start_pos);
 			}
 			// If BEHAVIOR lump found after BLOCKMAP, set map type as Hexen
 			else if (i - map_start_pos == ML_BEHAVIOR)
 			{
-				lumps[map_start_pos].subtype = MF_HEXEN;
+				lump_subtypes[map_start_pos] = MF_HEXEN;
 				map_start_pos = -1;
 			}
 		}
-		else if (lump.name == wfMapLumpTypeStr[ML_THINGS])
+		else if (name == map_lump_names[ML_THINGS])
 		{
 			// First lump in Doom/Hexen format is THINGS
 			map_start_pos = i - 1;
 		}
-		else if (lump.name == "TEXTMAP" && i > 0)
+		else if (name == textmap_name && i > 0)
 		{
 			// First lump in UDMF format is TEXTMAP
-			lumps[i-1].type = LT_MAP_HEADER;
-			lumps[i-1].subtype = MF_UDMF;
+			lump_types[i-1] = LT_MAP_HEADER;
+			lump_subtypes[i-1] = MF_UDMF;
+			add_lump_range(LT_MAP_HEADER, i-1);
 		}
-		else if (lump.name == "TEXTURE1" || lump.name == "TEXTURE2")
-			lumps[i].type = LT_MISC_TEXTURES;
+		else if (name == texture1_name || name == texture2_name)
+			lump_types[i] = LT_MISC_TEXTURES;
 		// Detect START and END markers (i.e for textures)
-		IF_MARKER("S_START", inside_sprites, 1)
-		IF_MARKER("S_END", inside_sprites, -1)
-		IF_MARKER("TX_START", inside_textures, 1)
-		IF_MARKER("TX_END", inside_textures, -1)
-		IF_MARKER("P_START", inside_patches, 1)
-		IF_MARKER("P1_START", inside_patches, 1)
-		IF_MARKER("P2_START", inside_patches, 1)
-		IF_MARKER("P3_START", inside_patches, 1)
-		IF_MARKER("PP_START", inside_patches, 1)
-		IF_MARKER("P_END", inside_patches, -1)
-		IF_MARKER("P1_END", inside_patches, -1)
-		IF_MARKER("P2_END", inside_patches, -1)
-		IF_MARKER("P3_END", inside_patches, -1)
-		IF_MARKER("PP_END", inside_patches, -1)
-		IF_MARKER("F_START", inside_flats, 1)
-		IF_MARKER("F1_START", inside_flats, 1)
-		IF_MARKER("F2_START", inside_flats, 1)
-		IF_MARKER("F3_START", inside_flats, 1)
-		IF_MARKER("FF_START", inside_flats, 1)
-		IF_MARKER("F_END", inside_flats, -1)
-		IF_MARKER("F1_END", inside_flats, -1)
-		IF_MARKER("F2_END", inside_flats, -1)
-		IF_MARKER("F3_END", inside_flats, -1)
-		IF_MARKER("FF_END", inside_flats, -1)
+		else if ((marker = find_marker(name)) != NULL)
+		{
+			lump_types[i] = LT_MISC_MARKER;
+			inside[marker->type] += marker->delta;
+		}
 		// Mark all sprites/textures/patches/flats
-		else if (inside_sprites)
+		else
 		{
-			lumps[i].type = LT_IMAGE_SPRITE;
+			for (int t = LT_IMAGE_SPRITE; t <= LT_IMAGE_FLAT; t++)
+			{
+				if (inside[t])
+				{
+					lump_types[i] = t;
+					add_lump_range(t, i);
+					break;
+				}
+			}
 		}
-		else if (inside_textures)
+	}
+	// Maps were recorded by their header, extend ranges to all map lumps
+	for (unsigned int m = 0; m < lump_ranges[LT_MAP_HEADER].size(); m++)
+	{
+		wfLumpRange &range = lump_ranges[LT_MAP_HEADER][m];
+		range.end = range.start + 1 + get_map_lump_count(range.start);
+	}
+}
+
+// *********************************************************** //
+// Index cache                                                 //
+// *********************************************************** //
+
+// The cache file stores parsed lump directory together with detected lump
+// types, so that loading an unchanged wad skips reading and processing it.
+// Cache files are stored in directory given by WADUTILS_INDEX_CACHE
+// environment variable, named after hash of full path of the wad file.
+
+#define INDEX_CACHE_VERSION 4
+
+struct wfIndexCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	// Stamp of the wad file. Times have nanoseconds where the system provides them,
+	// so that rewriting the file within the same second is still detected.
+	uint64_t file_size;
+	uint64_t file_inode;
+	int64_t file_mtime;
+	int64_t file_mtime_ns;
+	int64_t file_ctime;
+	int64_t file_ctime_ns;
+	uint64_t header_hash;
+	uint32_t num_lumps;
+	uint32_t path_length;
+};
+
+static void get_index_cache_stamp(const struct stat &st, wfIndexCacheHeader &cache_header)
+{
+	cache_header.file_size = st.st_size;
+	cache_header.file_inode = st.st_ino;
+	cache_header.file_mtime = st.st_mtime;
+	cache_header.file_ctime = st.st_ctime;
+#if defined(__APPLE__)
+	cache_header.file_mtime_ns = st.st_mtimespec.tv_nsec;
+	cache_header.file_ctime_ns = st.st_ctimespec.tv_nsec;
+#elif !defined(_WIN32)
+	cache_header.file_mtime_ns = st.st_mtim.tv_nsec;
+	cache_header.file_ctime_ns = st.st_ctim.tv_nsec;
+#else
+	cache_header.file_mtime_ns = 0;
+	cache_header.file_ctime_ns = 0;
+#endif
+}
+
+static bool get_index_cache_key(int fd, const string &filename, string &cache_filename, string &full_path, struct stat &st)
+{
+	const char *cache_dir = getenv("WADUTILS_INDEX_CACHE");
+	if (cache_dir == NULL || fstat(fd, &st) != 0)
+		return false;
+#ifndef _WIN32
+	char *path = realpath(filename.c_str(), NULL);
+	if (path == NULL)
+		return false;
+	full_path = path;
+	free(path);
+#else
+	full_path = filename;
+#endif
+	char name[24];
+	sprintf(name, "/%016llx.wfc", (unsigned long long)compute_hash(full_path.c_str(), full_path.size()));
+	cache_filename = string(cache_dir) + name;
+	return true;
+}
+
+bool WadFile::load_index_cache(const wadinfo_t &header)
+{
+	string cache_filename, full_path;
+	struct stat st;
+	if (!get_index_cache_key(source_fd, source_filename, cache_filename, full_path, st))
+		return false;
+	FILE *cache_file = fopen(cache_filename.c_str(), "rb");
+	if (cache_file == NULL)
+		return false;
+	// Check if cache belongs to the same unchanged file
+	wfIndexCacheHeader cache_header, stamp;
+	get_index_cache_stamp(st, stamp);
+	bool valid = fread(&cache_header, sizeof(cache_header), 1, cache_file) == 1 &&
+		strncmp(cache_header.magic, "WFIC", 4) == 0 &&
+		cache_header.version == INDEX_CACHE_VERSION &&
+		cache_header.file_size == stamp.file_size &&
+		cache_header.file_inode == stamp.file_inode &&
+		cache_header.file_mtime == stamp.file_mtime &&
+		cache_header.file_mtime_ns == stamp.file_mtime_ns &&
+		cache_header.file_ctime == stamp.file_ctime &&
+		cache_header.file_ctime_ns == stamp.file_ctime_ns &&
+		cache_header.header_hash == compute_hash(&header, sizeof(wadinfo_t)) &&
+		cache_header.num_lumps == (uint32_t)header.numnlumps &&
+		cache_header.path_length == full_path.size();
+	if (valid)
+	{
+		string path(full_path.size(), '\0');
+		valid = fread(&path[0], 1, path.size(), cache_file) == path.size() && path == full_path;
+	}
+	// Read all directory columns
+	int num_lumps = header.numnlumps;
+	if (valid)
+	{
+		resize_lump_directory(num_lumps);
+		valid = num_lumps == 0 || (
+			fread(&lump_names[0], sizeof(uint64_t), num_lumps, cache_file) == (unsigned)num_lumps &&
+			fread(&lump_file_pos[0], sizeof(uint32_t), num_lumps, cache_file) == (unsigned)num_lumps &&
+			fread(&lump_sizes[0], sizeof(uint32_t), num_lumps, cache_file) == (unsigned)num_lumps &&
+			fread(&lump_types[0], sizeof(uint8_t), num_lumps, cache_file) == (unsigned)num_lumps &&
+			fread(&lump_subtypes[0], sizeof(uint8_t), num_lumps, cache_file) == (unsigned)num_lumps);
+	}
+	// Read ranges of maps and namespaces
+	for (int t = 0; t < WF_NUM_LUMP_TYPES && valid; t++)
+	{
+		uint32_t num_ranges;
+		valid = fread(&num_ranges, sizeof(uint32_t), 1, cache_file) == 1 && num_ranges <= (uint32_t)num_lumps;
+		if (valid && num_ranges != 0)
 		{
-			lumps[i].type = LT_IMAGE_TEXTURE;
+			lump_ranges[t].resize(num_ranges);
+			valid = fread(&lump_ranges[t][0], sizeof(wfLumpRange), num_ranges, cache_file) == num_ranges;
 		}
-		else if (inside_patches)
+	}
+	fclose(cache_file);
+	// Corrupt cache must not make lump types, positions or ranges point out of bounds
+	for (int i = 0; i < num_lumps && valid; i++)
+		valid = lump_types[i] < WF_NUM_LUMP_TYPES && (lump_sizes[i] == 0 ||
+			(lump_file_pos[i] >= sizeof(wadinfo_t) && (uint64_t)lump_file_pos[i] + lump_sizes[i] <= stamp.file_size));
+	for (int t = 0; t < WF_NUM_LUMP_TYPES && valid; t++)
+		for (unsigned int r = 0; r < lump_ranges[t].size() && valid; r++)
+			valid = lump_ranges[t][r].start >= 0 && lump_ranges[t][r].start < lump_ranges[t][r].end && lump_ranges[t][r].end <= num_lumps;
+	if (!valid)
+	{
+		resize_lump_directory(0);
+		return false;
+	}
+	index_lump_names();
+	return true;
+}
+
+void WadFile::save_index_cache(const wadinfo_t &header)
+{
+	string cache_filename, full_path;
+	struct stat st;
+	if (!get_index_cache_key(source_fd, source_filename, cache_filename, full_path, st))
+		return;
+	// Write into temporary file first, so that readers never see partial cache
+	string tmp_filename = cache_filename + ".tmp";
+	FILE *cache_file = fopen(tmp_filename.c_str(), "wb");
+	if (cache_file == NULL)
+		return;
+	wfIndexCacheHeader cache_header;
+	memcpy(cache_header.magic, "WFIC", 4);
+	cache_header.version = INDEX_CACHE_VERSION;
+	get_index_cache_stamp(st, cache_header);
+	cache_header.header_hash = compute_hash(&header, sizeof(wadinfo_t));
+	cache_header.num_lumps = lump_names.size();
+	cache_header.path_length = full_path.size();
+	int num_lumps = lump_names.size();
+	fwrite(&cache_header, sizeof(cache_header), 1, cache_file);
+	fwrite(full_path.c_str(), 1, full_path.size(), cache_file);
+	if (num_lumps != 0)
+	{
+		fwrite(&lump_names[0], sizeof(uint64_t), num_lumps, cache_file);
+		fwrite(&lump_file_pos[0], sizeof(uint32_t), num_lumps, cache_file);
+		fwrite(&lump_sizes[0], sizeof(uint32_t), num_lumps, cache_file);
+		fwrite(&lump_types[0], sizeof(uint8_t), num_lumps, cache_file);
+		fwrite(&lump_subtypes[0], sizeof(uint8_t), num_lumps, cache_file);
+	}
+	for (int t = 0; t < WF_NUM_LUMP_TYPES; t++)
+	{
+		uint32_t num_ranges = lump_ranges[t].size();
+		fwrite(&num_ranges, sizeof(uint32_t), 1, cache_file);
+		if (num_ranges != 0)
+			fwrite(&lump_ranges[t][0], sizeof(wfLumpRange), num_ranges, cache_file);
+	}
+	if (fclose(cache_file) != 0 || rename(tmp_filename.c_str(), cache_filename.c_str()) != 0)
+		remove(tmp_filename.c_str());
+}
+
+// Planned positions of all lumps in saved wad file
+struct wfSaveLayout
+{
+	vector<filelump_t> directory;
+	vector<int> lumps; // Lump position for each directory entry
+	vector<int> write_order; // Directory entries whose data are stored, in file order
+	uint32_t directory_pos;
+	int dedup_saved_bytes;
+	bool too_large; // Data and directory would not fit in 32-bit offsets
+};
+
+bool WadFile::plan_save_layout(const wfSaveOptions &options, wfSaveLayout &layout)
+{
+	layout.too_large = false;
+	// Directory entries of all not deleted lumps
+	for (unsigned int i = 0; i < lump_names.size(); i++)
+	{
+		if (lump_flags[i] & LS_DELETED)
+			continue;
+		filelump_t entry;
+		memcpy(entry.name, &lump_names[i], 8);
+		entry.filepos = sizeof(wadinfo_t);
+		bool has_data = lump_data[i] != NULL || lump_file_pos[i] != 0 || packed_lumps.count(i);
+		entry.size = has_data ? lump_sizes[i] : 0;
+		layout.directory.push_back(entry);
+		layout.lumps.push_back(i);
+	}
+	int num_entries = layout.directory.size();
+
+	// Assign each lump into a group: other lumps, one group per map, one per namespace
+	vector<int> group(num_entries, 0);
+	vector<int> category(num_entries, 0);
+	// Map membership is taken from map ranges by lump position, as deleted
+	// lumps have no directory entry. Entries come in lump position order.
+	const vector<wfLumpRange> &maps = lump_ranges[LT_MAP_HEADER];
+	unsigned int m = 0;
+	for (int k = 0; k < num_entries; k++)
+	{
+		int lump_pos = layout.lumps[k];
+		int type = lump_types[lump_pos];
+		while (m < maps.size() && maps[m].end <= lump_pos)
+			m++;
+		if (m < maps.size() && lump_pos >= maps[m].start)
 		{
-			lumps[i].type = LT_IMAGE_PATCH;
+			category[k] = 1;
+			group[k] = maps[m].start;
 		}
-		else if (inside_flats)
+		else if (type >= LT_IMAGE_SPRITE)
 		{
-			lumps[i].type = LT_IMAGE_FLAT;
+			category[k] = 2 + type;
+			group[k] = -type;
 		}
 	}
-	free(lump_directory);
-	reset_cursor();
+	vector<int> order;
+	for (int k = 0; k < num_entries; k++)
+		if (layout.directory[k].size != 0)
+			order.push_back(k);
+	if (options.group_lumps)
+	{
+		vector<pair<int, int> > keys;
+		for (unsigned int j = 0; j < order.size(); j++)
+			keys.push_back(make_pair(category[order[j]], order[j]));
+		sort(keys.begin(), keys.end());
+		for (unsigned int j = 0; j < order.size(); j++)
+			order[j] = keys[j].second;
+	}
+
+	// Assign file positions to lump data. Position is counted in 64 bits,
+	// as data with alignment padding may not fit in 32-bit offsets.
+	uint64_t cur_pos = sizeof(wadinfo_t);
+	int prev_group = 0x7FFFFFFF;
+	// Already placed entries, by their content hash
+	unordered_map<uint64_t, vector<int> > placed_entries;
+	vector<char> buffer;
+	vector<char> compare_buffer;
+	layout.dedup_saved_bytes = 0;
+	for (unsigned int j = 0; j < order.size(); j++)
+	{
+		int k = order[j];
+		filelump_t &entry = layout.directory[k];
+		if (options.deduplicate)
+		{
+			// Point directory entry to identical lump, if it was already placed
+			const char *data = get_lump_contents(layout.lumps[k], buffer);
+			if (data == NULL)
+				return false;
+			vector<int> &candidates = placed_entries[compute_hash(data, entry.size)];
+			bool found = false;
+			for (unsigned int c = 0; c < candidates.size() && !found; c++)
+			{
+				if (layout.directory[candidates[c]].size != entry.size)
+					continue;
+				const char *other = get_lump_contents(layout.lumps[candidates[c]], compare_buffer);
+				if (other != NULL && memcmp(data, other, entry.size) == 0)
+				{
+					entry.filepos = layout.directory[candidates[c]].filepos;
+					layout.dedup_saved_bytes += entry.size;
+					found = true;
+				}
+			}
+			if (found)
+				continue;
+			candidates.push_back(k);
+		}
+		bool group_start = group[k] != prev_group || group[k] == 0;
+		if (options.alignment > 1 && (!options.align_groups_only || group_start))
+			cur_pos = (cur_pos + options.alignment - 1) / options.alignment * options.alignment;
+		prev_group = group[k];
+		entry.filepos = cur_pos;
+		cur_pos += entry.size;
+		layout.write_order.push_back(k);
+		if (cur_pos > 0xFFFFFFFF)
+			break;
+	}
+	layout.too_large = cur_pos + (uint64_t)sizeof(filelump_t) * num_entries > 0xFFFFFFFF;
+	if (layout.too_large)
+		return false;
+	layout.directory_pos = cur_pos;
+	// Empty lumps point just after preceding lump
+	uint32_t end_pos = sizeof(wadinfo_t);
+	for (int k = 0; k < num_entries; k++)
+	{
+		if (layout.directory[k].size == 0)
+			layout.directory[k].filepos = end_pos;
+		else
+			end_pos = layout.directory[k].filepos + layout.directory[k].size;
+	}
 	return true;
 }
 
-bool WadFile::save_wad_file(const char* filename, bool drop_contents)
+bool WadFile::save_wad_file(const char* filename, bool drop_contents, const wfSaveOptions &options)
 {
-	// Open wad file
-	FILE *target_file = fopen(filename, "wb");
-	if (target_file == NULL)
+	// Compute positions of all lumps in the file
+	wfSaveLayout layout;
+	if (!plan_save_layout(options, layout))
+	{
+		if (layout.too_large)
+			fprintf(stderr, "Cannot save file %s, it would exceed 4 GB\n",filename);
+		else
+			fprintf(stderr, "Failed to read lumps for %s\n",filename);
+		return false;
+	}
+	dedup_saved_bytes = layout.dedup_saved_bytes;
+
+	// Open wad file. Standard output and pipes cannot seek, they are written sequentially.
+	bool to_stdout = strcmp(filename, "-") == 0;
+	int target_fd = to_stdout ? fileno(stdout) : open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (target_fd == -1)
 	{
 		fprintf(stderr, "Failed to open file for write %s\n",filename);
 		return false;
 	}
+	if (to_stdout)
+		fflush(stdout);
+#ifdef _WIN32
+	if (to_stdout)
+		_setmode(target_fd, O_BINARY);
+#endif
+	bool streaming = options.streaming || to_stdout || lseek(target_fd, 0, SEEK_CUR) == -1;
+	uint32_t directory_size = sizeof(filelump_t) * layout.directory.size();
+	wadinfo_t header;
+	memcpy(header.identification, options.iwad ? "IWAD" : "PWAD", 4);
+	header.numnlumps = layout.directory.size();
+	header.infotableofs = layout.directory_pos;
 
-	// Write all lumps and lump directory
-	filelump_t *lump_directory = (filelump_t *)calloc(lumps.size(), sizeof(filelump_t));
-	int cur_pos = sizeof(wadinfo_t);
-	int cur_lump = 0;
-	fseek(target_file, sizeof(wadinfo_t), SEEK_SET);
+	// Write data of directory entry at given position, or at current position if pos is -1
+	auto write_lump = [&](int k, int64_t pos) -> bool
+	{
+		int lump_pos = layout.lumps[k];
+		if (lump_data[lump_pos] != NULL)
+		{
+			// Lump is loaded (and maybe modified), write it from memory
+			return write_all(target_fd, lump_data[lump_pos], lump_sizes[lump_pos], pos);
+		}
+		else if (lump_file_pos[lump_pos] == 0)
+		{
+			// Lump is packed in pk3 file, unpack it first
+			vector<char> buffer(lump_sizes[lump_pos]);
+			return read_lump_data(lump_pos, &buffer[0]) && write_all(target_fd, &buffer[0], lump_sizes[lump_pos], pos);
+		}
+		// Lump is unchanged, copy it directly from source file
+		return copy_file_data(source_fd, lump_file_pos[lump_pos], target_fd, pos, lump_sizes[lump_pos]);
+	};
 
-	for (unsigned int i = 0; i < lumps.size(); i++)
+	bool result = true;
+	if (streaming)
 	{
-		wfLump &lump = lumps[i];
-		if (lump.deleted)
-			continue;
-		strncpy(lump_directory[cur_lump].name, lump.name.c_str(), 8);
-		lump_directory[cur_lump].filepos = cur_pos;
-		char *data = get_lump_data(i);
-		if (data == NULL)
+		// Write header, lumps in file order with zero gaps between them, and directory
+		result = write_all(target_fd, (char *)&header, sizeof(wadinfo_t));
+		uint32_t cur_pos = sizeof(wadinfo_t);
+		for (unsigned int j = 0; j < layout.write_order.size() && result; j++)
 		{
-			lump_directory[cur_lump].size = 0;
+			int k = layout.write_order[j];
+			result = write_zeros(target_fd, layout.directory[k].filepos - cur_pos) && write_lump(k, -1);
+			cur_pos = layout.directory[k].filepos + layout.directory[k].size;
 		}
-		else
+		if (result)
+			result = write_zeros(target_fd, layout.directory_pos - cur_pos);
+		if (result && directory_size != 0)
+			result = write_all(target_fd, (char *)&layout.directory[0], directory_size);
+	}
+	else
+	{
+		// Set final size of file, gaps between lumps stay filled with zeros
+		result = ftruncate(target_fd, layout.directory_pos + directory_size) == 0;
+
+		// Write all lumps at their planned positions. Each thread takes next lump to write.
+		atomic<unsigned int> next_lump(0);
+		atomic<bool> write_ok(result);
+		auto write_lumps = [&]()
+		{
+			unsigned int j;
+			while (write_ok && (j = next_lump++) < layout.write_order.size())
+			{
+				int k = layout.write_order[j];
+				if (!write_lump(k, layout.directory[k].filepos))
+					write_ok = false;
+			}
+		};
+		vector<thread> threads;
+		for (int t = 1; t < options.num_threads; t++)
+			threads.push_back(thread(write_lumps));
+		write_lumps();
+		for (unsigned int t = 0; t < threads.size(); t++)
+			threads[t].join();
+		result = write_ok;
+
+		// Write lump directory and wad header
+		if (result && directory_size != 0)
+			result = write_all(target_fd, (char *)&layout.directory[0], directory_size, layout.directory_pos);
+		if (result)
+			result = write_all(target_fd, (char *)&header, sizeof(wadinfo_t), 0);
+	}
+	if (!result)
+		fprintf(stderr, "Failed to write file %s\n",filename);
+	if (!to_stdout)
+		close(target_fd);
+
+	if (drop_contents)
+	{
+		for (unsigned int k = 0; k < layout.lumps.size(); k++)
+			drop_lump_data(layout.lumps[k]);
+	}
+	return result;
+}
+
+bool WadFile::save_wad_file_incremental(bool drop_contents)
+{
+	if (!update_mode)
+		return false;
+	struct stat st;
+	wadinfo_t header;
+	if (fstat(source_fd, &st) != 0 || pread(source_fd, &header, sizeof(wadinfo_t), 0) != sizeof(wadinfo_t))
+		return false;
+	// Everything new goes after the current end of file, and all of it
+	// must stay within reach of 32-bit offsets in the directory
+	uint64_t new_end_pos = st.st_size;
+	int num_entries = 0;
+	for (unsigned int i = 0; i < lump_names.size(); i++)
+	{
+		if (lump_flags[i] & LS_DELETED)
+			continue;
+		if (lump_data[i] != NULL && lump_file_pos[i] == 0)
+			new_end_pos += lump_sizes[i];
+		num_entries++;
+	}
+	new_end_pos += (uint64_t)sizeof(filelump_t) * num_entries;
+	if (new_end_pos > 0xFFFFFFFF)
+	{
+		fprintf(stderr, "Cannot update file %s, it would exceed 4 GB\n", source_filename.c_str());
+		return false;
+	}
+	uint32_t end_pos = st.st_size;
+	filelump_t *lump_directory = (filelump_t *)calloc(lump_names.size(), sizeof(filelump_t));
+	int cur_lump = 0;
+	bool result = true;
+
+	for (unsigned int i = 0; i < lump_names.size() && result; i++)
+	{
+		if (lump_flags[i] & LS_DELETED)
+			continue;
+		// Write only lumps which changed: replaced or appended lumps go to the
+		// end of file, lumps modified in place are rewritten at their position
+		if (lump_data[i] != NULL && lump_sizes[i] != 0 && (lump_file_pos[i] == 0 || (lump_flags[i] & LS_MODIFIED)))
 		{
-			lump_directory[cur_lump].size = lump.size;
-			fwrite(data, 1, lump.size, target_file);
-			cur_pos += lump.size;
+			if (lump_file_pos[i] == 0)
+			{
+				lump_file_pos[i] = end_pos;
+				end_pos += lump_sizes[i];
+			}
+			result = write_all(source_fd, lump_data[i], lump_sizes[i], lump_file_pos[i]);
+			if (result)
+				lump_flags[i] &= ~LS_MODIFIED;
 		}
+		memcpy(lump_directory[cur_lump].name, &lump_names[i], 8);
+		lump_directory[cur_lump].filepos = lump_file_pos[i];
+		lump_directory[cur_lump].size = lump_sizes[i];
 		if (drop_contents)
 			drop_lump_data(i);
 		cur_lump++;
 	}
-	fwrite(lump_directory, sizeof(filelump_t), cur_lump, target_file);
-
-	// Write wad header
-	wadinfo_t header;
-	strncpy(header.identification, "PWAD", 4);
+	// Write new directory and finally point the header to it
+	if (result)
+		result = pwrite(source_fd, lump_directory, sizeof(filelump_t) * cur_lump, end_pos) == (signed)(sizeof(filelump_t) * cur_lump);
 	header.numnlumps = cur_lump;
-	header.infotableofs = cur_pos;
-	fseek(target_file, 0, SEEK_SET);
-	fwrite(&header, sizeof(wadinfo_t), 1, target_file);
+	header.infotableofs = end_pos;
+	if (result)
+		result = pwrite(source_fd, &header, sizeof(wadinfo_t), 0) == sizeof(wadinfo_t);
+	if (!result)
+		fprintf(stderr, "Failed to update file %s\n", source_filename.c_str());
 
 	free(lump_directory);
-	fclose(target_file);
-	return true;
+	return result;
+}
+
+bool WadFile::compact_wad_file()
+{
+	if (!update_mode)
+		return false;
+	// Rewrite the wad without dead space into temporary file and replace the original.
+	// Lump data are kept until the original is replaced, so nothing is lost on failure.
+	string filename = source_filename;
+	string tmp_filename = filename + ".tmp";
+	wfSaveOptions options;
+	options.iwad = is_iwad;
+	if (!save_wad_file(tmp_filename.c_str(), false, options))
+	{
+		unlink(tmp_filename.c_str());
+		return false;
+	}
+	if (rename(tmp_filename.c_str(), filename.c_str()) != 0)
+	{
+		fprintf(stderr, "Failed to replace file %s\n", filename.c_str());
+		unlink(tmp_filename.c_str());
+		return false;
+	}
+	return load_wad_file(filename.c_str(), true, load_flags);
 }
 
 bool WadFile::save_lump_into_file(int lump_pos)
 {
 	// Invalid lump position
-	if (lump_pos < 0 || lump_pos >= (signed)lumps.size())
+	if (!is_valid_pos(lump_pos))
 		return false;
 	// Save the lump
 	char *data = get_lump_data(lump_pos);
 	if (data == NULL)
 		return false;
-	wfLump &lump = lumps[lump_pos];
-	FILE *lump_file = fopen((lump.name + ".lmp").c_str(), "wb");
+	FILE *lump_file = fopen((string(lump_name_strs[lump_pos].str) + ".lmp").c_str(), "wb");
 	if (lump_file == NULL)
 		return false;
-	fwrite(data, 1, lump.size, lump_file);
+	fwrite(data, 1, lump_sizes[lump_pos], lump_file);
 	fclose(lump_file);
 	return true;
 }
@@ -245,147 +1112,779 @@ int WadFile::find_lump_by_name(const string &name)
 
 int WadFile::find_next_lump_by_name(const string &name)
 {
-	for (unsigned int i = cursor_pos + 1; i < lumps.size(); i++)
+	int lump_pos = find_lump_by_name_after(name, cursor_pos);
+	if (lump_pos == -1)
+		reset_cursor();
+	else
+		cursor_pos = lump_pos;
+	return lump_pos;
+}
+
+int WadFile::find_last_lump_by_name(const string &name) const
+{
+	if (name.size() > 8)
+		return -1;
+	const wfNameSlot *slot = find_name(pack_name(name.c_str()));
+	return slot ? slot->last : -1;
+}
+
+int WadFile::find_next_lump_by_type(int type)
+{
+	int lump_pos = find_lump_by_type_after(type, cursor_pos);
+	if (lump_pos == -1)
+		reset_cursor();
+	else
+		cursor_pos = lump_pos;
+	return lump_pos;
+}
+
+int WadFile::find_lump_by_name_after(const string &name, int lump_pos) const
+{
+	if (name.size() > 8)
+		return -1;
+	wfLumpFilter filter = {LFK_NAME, 0, pack_name(name.c_str())};
+	return find_lump_after(filter, lump_pos);
+}
+
+int WadFile::find_lump_after(const wfLumpFilter &filter, int lump_pos) const
+{
+	if (filter.kind == LFK_TYPE)
+		return find_lump_by_type_after(filter.type, lump_pos);
+	if (filter.kind == LFK_NAME)
 	{
-		cursor_pos = i;
-		if (lumps[i].name == name)
-			return i;
+		// From a lump with the same name follow its link, otherwise
+		// follow the links from the first lump with the name
+		if (is_valid_pos(lump_pos) && lump_names[lump_pos] == filter.name)
+			return next_same_name[lump_pos];
+		const wfNameSlot *slot = find_name(filter.name);
+		int pos = slot ? slot->first : -1;
+		while (pos != -1 && pos <= lump_pos)
+			pos = next_same_name[pos];
+		return pos;
 	}
-	reset_cursor();
-	return -1;
+	if (filter.kind == LFK_NONE)
+		return -1;
+	return is_valid_pos(lump_pos + 1) ? lump_pos + 1 : -1;
 }
 
-int WadFile::find_next_lump_by_type(int type)
+wfLumpList WadFile::all_lumps() const
 {
-	for (unsigned int i = cursor_pos + 1; i < lumps.size(); i++)
+	wfLumpFilter filter = {LFK_ALL, 0, 0};
+	return wfLumpList(this, filter);
+}
+
+wfLumpList WadFile::lumps_by_type(int type) const
+{
+	wfLumpFilter filter = {LFK_TYPE, type, 0};
+	return wfLumpList(this, filter);
+}
+
+wfLumpList WadFile::lumps_by_name(const string &name) const
+{
+	// Names longer than 8 characters never match
+	wfLumpFilter filter = {name.size() > 8 ? LFK_NONE : LFK_NAME, 0, pack_name(name.c_str())};
+	return wfLumpList(this, filter);
+}
+
+int WadFile::find_lump_by_type_after(int type, int lump_pos) const
+{
+	// Maps and namespace lumps are found by binary search in their ranges,
+	// which are sorted and do not overlap (so their ends are sorted too)
+	if (type == LT_MAP_HEADER)
+	{
+		const vector<wfLumpRange> &ranges = lump_ranges[type];
+		vector<wfLumpRange>::const_iterator it = upper_bound(ranges.begin(), ranges.end(), lump_pos,
+			[](int pos, const wfLumpRange &range) {return pos < range.start;});
+		return (it == ranges.end()) ? -1 : it->start;
+	}
+	if (type >= LT_IMAGE_SPRITE && type <= LT_IMAGE_FLAT)
+	{
+		const vector<wfLumpRange> &ranges = lump_ranges[type];
+		vector<wfLumpRange>::const_iterator it = upper_bound(ranges.begin(), ranges.end(), lump_pos + 1,
+			[](int pos, const wfLumpRange &range) {return pos < range.end;});
+		return (it == ranges.end()) ? -1 : max(it->start, lump_pos + 1);
+	}
+	for (unsigned int i = lump_pos + 1; i < lump_types.size(); i++)
 	{
-		cursor_pos = i;
-		if (lumps[i].type == type)
+		if (lump_types[i] == type)
 			return i;
 	}
-	reset_cursor();
 	return -1;
 }
 
-const char *WadFile::get_lump_name(int lump_pos)
+const char *WadFile::get_lump_name(int lump_pos) const
 {
-	if (lump_pos >= 0 && lump_pos < (signed)lumps.size())
-		return lumps[lump_pos].name.c_str();
+	if (is_valid_pos(lump_pos))
+		return lump_name_strs[lump_pos].str;
 	else
 		return NULL;
 }
 
-int WadFile::get_lump_size(int lump_pos)
+uint32_t WadFile::get_lump_size(int lump_pos) const
 {
-	if (lump_pos >= 0 && lump_pos < (signed)lumps.size())
-		return lumps[lump_pos].size;
+	if (is_valid_pos(lump_pos))
+		return lump_sizes[lump_pos];
 	else
-		return -1;
+		return 0;
+}
+
+uint32_t WadFile::get_lump_file_pos(int lump_pos) const
+{
+	if (is_valid_pos(lump_pos))
+		return lump_file_pos[lump_pos];
+	else
+		return 0;
 }
 
 char *WadFile::get_lump_data(int lump_pos)
 {
 	// Invalid lump position
-	if (lump_pos < 0 || lump_pos >= (signed)lumps.size())
+	if (!is_valid_pos(lump_pos))
 		return NULL;
-	wfLump &lump = lumps[lump_pos];
 	// Data already exist
-	if (lump.data != NULL)
-		return lump.data;
+	if (lump_data[lump_pos] != NULL)
+	{
+		if (data_budget != 0)
+		{
+			unordered_map<int, list<int>::iterator>::iterator it = cached_lump_pos.find(lump_pos);
+			if (it != cached_lump_pos.end())
+				cached_lumps.splice(cached_lumps.begin(), cached_lumps, it->second);
+		}
+		return lump_data[lump_pos];
+	}
 	// Lump data is empty
-	if (lump.size == 0)
+	uint32_t size = lump_sizes[lump_pos];
+	if (size == 0)
 		return NULL;
-	// Lump not contained in source file
-	if (lump.source_file_pos == 0)
+	// Lump not contained in source file as is
+	uint32_t file_pos = lump_file_pos[lump_pos];
+	if (file_pos == 0)
+		return load_packed_lump(lump_pos);
+	// Return pointer into mapped file
+	if (mapping && (size_t)file_pos + size <= mapping_size)
+	{
+		lump_data[lump_pos] = mapping + file_pos;
+		lump_flags[lump_pos] |= LS_MAPPED;
+		return lump_data[lump_pos];
+	}
+	// Load the lump from file, making space for it within data budget
+	evict_cached_lumps(size);
+	char *data = (char *)malloc(size);
+	if (read_source(data, size, file_pos) != (int64_t)size)
+	{
+		free(data);
 		return NULL;
-	// Load the lump from file
-	char *data = (char *)malloc(lump.size);
-	fseek(source_file, lump.source_file_pos, SEEK_SET);
-	fread(data, 1, lump.size, source_file);
-	lump.data = data;
+	}
+	lump_data[lump_pos] = data;
+	add_cached_lump(lump_pos);
 	return data;
 }
 
-int WadFile::get_lump_subtype(int lump_pos)
+void WadFile::set_lump_data_budget(size_t bytes)
+{
+	data_budget = bytes;
+	evict_cached_lumps(0);
+}
+
+void WadFile::mark_lump_modified(int lump_pos)
+{
+	if (!is_valid_pos(lump_pos))
+		return;
+	lump_flags[lump_pos] |= LS_MODIFIED;
+	uncache_lump(lump_pos);
+}
+
+// Add just loaded lump to the list of evictable lumps
+void WadFile::add_cached_lump(int lump_pos)
+{
+	if (data_budget == 0)
+		return;
+	cached_lumps.push_front(lump_pos);
+	cached_lump_pos[lump_pos] = cached_lumps.begin();
+	cached_data_size += lump_sizes[lump_pos];
+}
+
+// Remove lump from the list of evictable lumps
+void WadFile::uncache_lump(int lump_pos)
+{
+	unordered_map<int, list<int>::iterator>::iterator it = cached_lump_pos.find(lump_pos);
+	if (it == cached_lump_pos.end())
+		return;
+	cached_lumps.erase(it->second);
+	cached_lump_pos.erase(it);
+	cached_data_size -= lump_sizes[lump_pos];
+}
+
+// Drop least recently used clean lumps until needed bytes fit into budget
+void WadFile::evict_cached_lumps(size_t needed)
+{
+	if (data_budget == 0)
+		return;
+	while (!cached_lumps.empty() && cached_data_size + needed > data_budget)
+	{
+		int lump_pos = cached_lumps.back();
+		uncache_lump(lump_pos);
+		free(lump_data[lump_pos]);
+		lump_data[lump_pos] = NULL;
+	}
+}
+
+// Get lump contents without keeping them loaded: either loaded data,
+// mapped file or given buffer filled from the file
+const char *WadFile::get_lump_contents(int lump_pos, vector<char> &buffer) const
+{
+	uint32_t size = lump_sizes[lump_pos];
+	if (lump_data[lump_pos] != NULL)
+		return lump_data[lump_pos];
+	uint32_t file_pos = lump_file_pos[lump_pos];
+	if (mapping && file_pos != 0 && (size_t)file_pos + size <= mapping_size)
+		return mapping + file_pos;
+	buffer.resize(size + 1);
+	if (!read_lump_data(lump_pos, &buffer[0]))
+		return NULL;
+	return &buffer[0];
+}
+
+bool WadFile::read_lump_data(int lump_pos, char *buffer) const
+{
+	if (!is_valid_pos(lump_pos))
+		return false;
+	return read_lump_part(lump_pos, buffer, 0, lump_sizes[lump_pos]) == (signed)lump_sizes[lump_pos];
+}
+
+int WadFile::read_lump_part(int lump_pos, char *buffer, int offset, int size) const
+{
+	// Invalid lump position or range
+	if (!is_valid_pos(lump_pos) || offset < 0 || size < 0)
+		return -1;
+	// Read only the part which is inside the lump
+	if ((uint32_t)offset >= lump_sizes[lump_pos])
+		return 0;
+	size = min((uint32_t)size, lump_sizes[lump_pos] - offset);
+	// Copy data which are already loaded or mapped
+	if (lump_data[lump_pos] != NULL)
+	{
+		memcpy(buffer, lump_data[lump_pos] + offset, size);
+		return size;
+	}
+	// Lump not contained in source file as is, maybe it is packed in pk3
+	uint32_t file_pos = lump_file_pos[lump_pos];
+	if (file_pos == 0)
+	{
+		unordered_map<int, wfPackedLump>::const_iterator it = packed_lumps.find(lump_pos);
+		if (it == packed_lumps.end())
+			return -1;
+		return read_packed_lump_part(it->second, buffer, offset, size);
+	}
+	if (mapping && (size_t)file_pos + lump_sizes[lump_pos] <= mapping_size)
+	{
+		memcpy(buffer, mapping + file_pos + offset, size);
+		return size;
+	}
+	return read_source(buffer, size, (int64_t)file_pos + offset);
+}
+
+// Read any data from source file, mapped or not
+bool WadFile::read_source_data(char *buffer, uint32_t size, uint32_t pos) const
 {
-	if (lump_pos >= 0 && lump_pos < (signed)lumps.size())
-		return lumps[lump_pos].subtype;
+	if (mapping && (size_t)pos + size <= mapping_size)
+	{
+		memcpy(buffer, mapping + pos, size);
+		return true;
+	}
+	return read_source(buffer, size, pos) == (int64_t)size;
+}
+
+// Read from source file, measuring time spent waiting for the data.
+// Returns number of bytes read, which is less than size at end of file.
+int64_t WadFile::read_source(char *buffer, size_t size, int64_t pos) const
+{
+	chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+	int64_t total = 0;
+	while ((size_t)total < size)
+	{
+		// Single read may return less data than requested (i.e. over 2 GB)
+		int64_t read_cnt = pread(source_fd, buffer + total, min(size - (size_t)total, (size_t)0x40000000), pos + total);
+		if (read_cnt <= 0)
+			break;
+		total += read_cnt;
+	}
+	io_wait_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time).count();
+	return (total == 0 && size != 0) ? -1 : total;
+}
+
+int WadFile::get_lump_type(int lump_pos) const
+{
+	if (is_valid_pos(lump_pos))
+		return lump_types[lump_pos];
 	else
 		return -1;
 }
 
+int WadFile::get_lump_subtype(int lump_pos) const
+{
+	if (is_valid_pos(lump_pos))
+		return lump_subtypes[lump_pos];
+	else
+		return -1;
+}
+
+int WadFile::get_map_lump_count(int map_lump_pos) const
+{
+	if (get_lump_type(map_lump_pos) != LT_MAP_HEADER)
+		return 0;
+	int subtype = lump_subtypes[map_lump_pos];
+	if (subtype == MF_UDMF)
+	{
+		// UDMF map lumps end with ENDMAP
+		for (unsigned int i = map_lump_pos + 1; i < lump_names.size(); i++)
+		{
+			if (lump_names[i] == pack_name("ENDMAP"))
+				return i - map_lump_pos;
+		}
+		return lump_names.size() - 1 - map_lump_pos;
+	}
+	else if (subtype == MF_HEXEN)
+	{
+		// SCRIPTS lump is optional
+		if (is_valid_pos(map_lump_pos + ML_SCRIPTS) && lump_names[map_lump_pos + ML_SCRIPTS] == pack_name(wfMapLumpTypeStr[ML_SCRIPTS]))
+			return ML_SCRIPTS;
+		return ML_BEHAVIOR;
+	}
+	return ML_BLOCKMAP;
+}
+
+// Find byte range of file covering all map lumps (only those not loaded yet, if
+// unloaded_only is set). Returns total size of the lumps, zero if there is nothing to read.
+uint32_t WadFile::get_map_block_span(int map_lump_pos, bool unloaded_only, uint32_t &block_start, uint32_t &block_end) const
+{
+	int count = get_map_lump_count(map_lump_pos);
+	block_start = 0xFFFFFFFF;
+	block_end = 0;
+	uint32_t total_size = 0;
+	for (int i = map_lump_pos + 1; i <= map_lump_pos + count; i++)
+	{
+		if ((unloaded_only && lump_data[i] != NULL) || lump_sizes[i] == 0 || lump_file_pos[i] == 0)
+			continue;
+		block_start = min(block_start, lump_file_pos[i]);
+		block_end = max(block_end, lump_file_pos[i] + lump_sizes[i]);
+		total_size += lump_sizes[i];
+	}
+	return total_size;
+}
+
+bool WadFile::load_map_block(int map_lump_pos)
+{
+	int count = get_map_lump_count(map_lump_pos);
+	if (count == 0)
+		return false;
+	bool result = read_map_block(map_lump_pos);
+	// Let the system read next map in background while this one is processed
+	int next_map_pos = find_lump_by_type_after(LT_MAP_HEADER, map_lump_pos);
+	if (next_map_pos != -1)
+		prefetch_map_block(next_map_pos);
+	return result;
+}
+
+void WadFile::prefetch_map_block(int map_lump_pos) const
+{
+	uint32_t block_start, block_end;
+	if (get_map_block_span(map_lump_pos, false, block_start, block_end) == 0)
+		return;
+#ifndef _WIN32
+	if (mapping && block_end <= mapping_size)
+	{
+		// Range for madvise must start at page boundary
+		uint32_t page_size = get_page_size();
+		uint32_t aligned_start = block_start / page_size * page_size;
+		madvise(mapping + aligned_start, block_end - aligned_start, MADV_WILLNEED);
+		return;
+	}
+#endif
+#ifdef POSIX_FADV_WILLNEED
+	posix_fadvise(source_fd, block_start, block_end - block_start, POSIX_FADV_WILLNEED);
+#endif
+}
+
+bool WadFile::read_map_block(int map_lump_pos)
+{
+	int count = get_map_lump_count(map_lump_pos);
+	uint32_t block_start, block_end;
+	// Lumps are accessed directly in mapped file, just fault in their pages now
+	if (mapping)
+	{
+		if (get_map_block_span(map_lump_pos, false, block_start, block_end) == 0 || block_end > mapping_size)
+			return true;
+		chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+		uint32_t page_size = get_page_size();
+		volatile char sum = 0;
+		for (uint32_t pos = block_start; pos < block_end; pos += page_size)
+			sum += mapping[pos];
+		sum += mapping[block_end - 1];
+		io_wait_ns += chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start_time).count();
+		return true;
+	}
+	if (map_blocks.find(map_lump_pos) != map_blocks.end())
+		return true;
+	// Find byte range covering all map lumps which need to be loaded
+	uint32_t total_size = get_map_block_span(map_lump_pos, true, block_start, block_end);
+	if (total_size == 0)
+		return true;
+	// Lumps are scattered over the file, better load them one by one
+	if (block_end - block_start > total_size * 2)
+		return false;
+	// Load whole block and distribute it among lumps
+	char *block = (char *)malloc(block_end - block_start);
+	if (read_source(block, block_end - block_start, block_start) != (int64_t)(block_end - block_start))
+	{
+		free(block);
+		return false;
+	}
+	for (int i = map_lump_pos + 1; i <= map_lump_pos + count; i++)
+	{
+		if (lump_data[i] != NULL || lump_sizes[i] == 0 || lump_file_pos[i] == 0)
+			continue;
+		lump_data[i] = block + (lump_file_pos[i] - block_start);
+		lump_flags[i] |= LS_IN_BLOCK;
+	}
+	map_blocks[map_lump_pos] = block;
+	return true;
+}
+
+void WadFile::drop_map_block(int map_lump_pos)
+{
+	map<int, char *>::iterator it = map_blocks.find(map_lump_pos);
+	if (it == map_blocks.end())
+		return;
+	int count = get_map_lump_count(map_lump_pos);
+	for (int i = map_lump_pos + 1; i <= map_lump_pos + count; i++)
+	{
+		if (!(lump_flags[i] & LS_IN_BLOCK))
+			continue;
+		// Lumps modified in place keep their data in own buffer
+		if (lump_flags[i] & LS_MODIFIED)
+		{
+			char *data = (char *)malloc(lump_sizes[i]);
+			memcpy(data, lump_data[i], lump_sizes[i]);
+			lump_data[i] = data;
+			lump_flags[i] &= ~LS_IN_BLOCK;
+		}
+		else
+			drop_lump_data(i);
+	}
+	free(it->second);
+	map_blocks.erase(it);
+}
+
+// *********************************************************** //
+// Lump buffers                                                //
+// *********************************************************** //
+
+#define ARENA_CHUNK_SIZE 65536
+#define ARENA_MAX_BUFFER_SIZE 4096
+#define ARENA_ALIGNMENT 16
+
+char *WadFile::alloc_lump_buffer(size_t size)
+{
+	// Large buffers are allocated separately
+	if (size > ARENA_MAX_BUFFER_SIZE)
+	{
+		char *data = (char *)calloc(size, 1);
+		if (data != NULL)
+			shared_buffers[data] = 0;
+		return data;
+	}
+	// Small buffers are taken from the last arena chunk
+	size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+	if (arena_chunks.empty() || arena_chunk_used + size > ARENA_CHUNK_SIZE)
+	{
+		char *chunk = (char *)calloc(ARENA_CHUNK_SIZE, 1);
+		if (chunk == NULL)
+			return NULL;
+		arena_chunks.insert(chunk);
+		arena_last_chunk = chunk;
+		arena_chunk_used = 0;
+	}
+	char *data = arena_last_chunk + arena_chunk_used;
+	arena_chunk_used += size;
+	return data;
+}
+
+char *WadFile::share_lump_data(int lump_pos)
+{
+	char *data = get_lump_data(lump_pos);
+	if (data == NULL || (lump_flags[lump_pos] & (LS_ARENA | LS_SHARED)))
+		return data;
+	if (!(lump_flags[lump_pos] & LS_NOT_OWNED))
+	{
+		// Lump owns its buffer, let the wad count references to it instead
+		uncache_lump(lump_pos);
+		shared_buffers[data] = 1;
+		lump_flags[lump_pos] |= LS_SHARED;
+		return data;
+	}
+	// Data belong to the mapping, a map block or the caller, copy them
+	char *copy = alloc_lump_buffer(lump_sizes[lump_pos] + 1);
+	if (copy == NULL)
+		return NULL;
+	memcpy(copy, data, lump_sizes[lump_pos]);
+	int modified = lump_flags[lump_pos] & LS_MODIFIED;
+	drop_lump_data(lump_pos);
+	set_lump_buffer(lump_pos, copy, false);
+	lump_flags[lump_pos] |= modified;
+	return copy;
+}
+
+bool WadFile::is_arena_buffer(char *data) const
+{
+	set<char *>::const_iterator it = arena_chunks.upper_bound(data);
+	if (it == arena_chunks.begin())
+		return false;
+	it--;
+	return data < *it + ARENA_CHUNK_SIZE;
+}
+
+// Set lump data pointer together with flags telling who owns the data
+void WadFile::set_lump_buffer(int lump_pos, char *data, bool nofree)
+{
+	lump_data[lump_pos] = data;
+	lump_flags[lump_pos] &= ~(LS_DONT_FREE | LS_ARENA | LS_SHARED);
+	if (data == NULL)
+		return;
+	unordered_map<char *, int>::iterator it = shared_buffers.find(data);
+	if (it != shared_buffers.end())
+	{
+		it->second++;
+		lump_flags[lump_pos] |= LS_SHARED;
+	}
+	else if (is_arena_buffer(data))
+		lump_flags[lump_pos] |= LS_ARENA;
+	else if (nofree)
+		lump_flags[lump_pos] |= LS_DONT_FREE;
+}
+
+void WadFile::release_shared_buffer(char *data)
+{
+	unordered_map<char *, int>::iterator it = shared_buffers.find(data);
+	if (it == shared_buffers.end() || --it->second > 0)
+		return;
+	free(data);
+	shared_buffers.erase(it);
+}
+
 void WadFile::replace_lump_data(int lump_pos, char *data, int size, bool nofree)
 {
-	if (lump_pos < 0 || lump_pos >= (signed)lumps.size())
+	if (!is_valid_pos(lump_pos))
 		return;
 	drop_lump_data(lump_pos);
-	wfLump &lump = lumps[lump_pos];
-	lump.source_file_pos = 0;
-	lump.data = data;
-	lump.size = size;
-	lump.dont_free = nofree;
+	lump_file_pos[lump_pos] = 0;
+	packed_lumps.erase(lump_pos);
+	lump_flags[lump_pos] |= LS_MODIFIED;
+	lump_sizes[lump_pos] = size;
+	set_lump_buffer(lump_pos, data, nofree);
 }
 
 void WadFile::update_lump_data(int lump_pos)
 {
 	if (!update_mode)
 		return;
-	if (lump_pos < 0 || lump_pos >= (signed)lumps.size())
+	if (!is_valid_pos(lump_pos))
 		return;
-	wfLump &lump = lumps[lump_pos];
-	if (lump.source_file_pos == 0)
+	if (lump_file_pos[lump_pos] == 0)
 		return;
-	fseek(source_file, lump.source_file_pos, SEEK_SET);
-	fwrite(lump.data, 1, lump.size, source_file);
+	pwrite(source_fd, lump_data[lump_pos], lump_sizes[lump_pos], lump_file_pos[lump_pos]);
 }
 
 void WadFile::drop_lump_data(int lump_pos)
 {
-	if (lump_pos < 0 || lump_pos >= (signed)lumps.size())
+	if (!is_valid_pos(lump_pos))
 		return;
-	wfLump &lump = lumps[lump_pos];
-	if (lump.data == NULL)
+	if (lump_data[lump_pos] == NULL)
 		return;
-	if (!lumps[lump_pos].dont_free)
-		free(lump.data);
-	lump.data = NULL;
+	uncache_lump(lump_pos);
+	if (!(lump_flags[lump_pos] & LS_NOT_OWNED))
+		free(lump_data[lump_pos]);
+	else if (lump_flags[lump_pos] & LS_SHARED)
+		release_shared_buffer(lump_data[lump_pos]);
+	lump_data[lump_pos] = NULL;
+	lump_flags[lump_pos] &= ~(LS_MAPPED | LS_IN_BLOCK | LS_MODIFIED | LS_ARENA | LS_SHARED);
 }
 
 void WadFile::delete_lump(int lump_pos, bool drop_contents)
 {
-	if (lump_pos < 0 || lump_pos >= (signed)lumps.size())
+	if (!is_valid_pos(lump_pos))
 		return;
-	lumps[lump_pos].deleted = true;
+	lump_flags[lump_pos] |= LS_DELETED;
 	if (drop_contents)
 		drop_lump_data(lump_pos);
 }
 
 void WadFile::append_lump(string name, int size, char *data, int type, int subtype, bool nofree)
 {
-	lumps.resize(lumps.size() + 1);
-	wfLump &lump = lumps[lumps.size() - 1];
-	lump.name = name;
-	lump.source_file_pos = 0;
-	lump.size = size;
-	lump.data = data;
-	lump.type = type;
-	lump.subtype = subtype;
-	lump.deleted = false;
-	lump.dont_free = nofree;
+	wfLumpName name_str = {{0}};
+	strncpy(name_str.str, name.c_str(), 8);
+	lump_names.push_back(pack_name(name.c_str()));
+	lump_name_strs.push_back(name_str);
+	lump_file_pos.push_back(0);
+	lump_sizes.push_back(size);
+	lump_data.push_back(NULL);
+	lump_types.push_back(type);
+	lump_subtypes.push_back(subtype);
+	lump_flags.push_back(0);
+	int lump_pos = lump_names.size() - 1;
+	set_lump_buffer(lump_pos, data, nofree);
+	// Appended map lumps extend the last map, if it ends just before them
+	vector<wfLumpRange> &maps = lump_ranges[LT_MAP_HEADER];
+	if (type == LT_MAP_HEADER || (type >= LT_IMAGE_SPRITE && type <= LT_IMAGE_FLAT))
+		add_lump_range(type, lump_pos);
+	else if (!maps.empty() && maps.back().end == lump_pos && is_map_lump_name(lump_names[lump_pos]))
+		maps.back().end++;
+	next_same_name.push_back(-1);
+	add_name_index(lump_pos);
 }
 
 // *********************************************************** //
 // Frequently used auxiliary functions                         //
 // *********************************************************** //
 
-uint32_t compute_hash(uint8_t *data, int size)
+// The hash uses four independent lanes of multiply-rotate rounds over
+// 8-byte words (the xxHash64 construction), so that the rounds can run
+// in parallel. Words are read with memcpy to allow any alignment.
+
+static const uint64_t HASH_PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t HASH_PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t HASH_PRIME3 = 0x165667B19E3779F9ULL;
+static const uint64_t HASH_PRIME4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t HASH_PRIME5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t hash_rotl(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static inline uint64_t hash_read64(const uint8_t *data)
+{
+	uint64_t value;
+	memcpy(&value, data, 8);
+	return value;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+	acc += input * HASH_PRIME2;
+	return hash_rotl(acc, 31) * HASH_PRIME1;
+}
+
+static inline uint64_t hash_merge_round(uint64_t acc, uint64_t lane)
+{
+	acc ^= hash_round(0, lane);
+	return acc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+// Process all whole 32-byte stripes, returns number of bytes consumed
+static inline size_t hash_stripes(uint64_t *lanes, const uint8_t *data, size_t size)
+{
+	uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+	const uint8_t *p = data;
+	const uint8_t *end = data + (size & ~(size_t)31);
+	for (; p < end; p += 32)
+	{
+		v1 = hash_round(v1, hash_read64(p));
+		v2 = hash_round(v2, hash_read64(p + 8));
+		v3 = hash_round(v3, hash_read64(p + 16));
+		v4 = hash_round(v4, hash_read64(p + 24));
+	}
+	lanes[0] = v1; lanes[1] = v2; lanes[2] = v3; lanes[3] = v4;
+	return p - data;
+}
+
+// Combine lanes with remaining bytes (less than 32) into final hash
+static uint64_t hash_finish(const uint64_t *lanes, const uint8_t *tail, size_t tail_size, uint64_t total_size, uint64_t seed)
 {
-	uint32_t result = 0;
-	for (int i = 0; i < size; i++)
+	uint64_t result;
+	if (total_size >= 32)
+	{
+		result = hash_rotl(lanes[0], 1) + hash_rotl(lanes[1], 7) + hash_rotl(lanes[2], 12) + hash_rotl(lanes[3], 18);
+		for (int i = 0; i < 4; i++)
+			result = hash_merge_round(result, lanes[i]);
+	}
+	else
+		result = seed + HASH_PRIME5;
+	result += total_size;
+	for (; tail_size >= 8; tail += 8, tail_size -= 8)
+	{
+		result ^= hash_round(0, hash_read64(tail));
+		result = hash_rotl(result, 27) * HASH_PRIME1 + HASH_PRIME4;
+	}
+	if (tail_size >= 4)
 	{
-		uint32_t val = data[i];
-		val <<= (3 - ((i + (i/4)) & 3)) * 8;
-		result += val;
+		uint32_t word;
+		memcpy(&word, tail, 4);
+		result ^= word * HASH_PRIME1;
+		result = hash_rotl(result, 23) * HASH_PRIME2 + HASH_PRIME3;
+		tail += 4;
+		tail_size -= 4;
 	}
+	for (; tail_size > 0; tail++, tail_size--)
+	{
+		result ^= *tail * HASH_PRIME5;
+		result = hash_rotl(result, 11) * HASH_PRIME1;
+	}
+	// Final avalanche, so that every input bit affects all output bits
+	result ^= result >> 33;
+	result *= HASH_PRIME2;
+	result ^= result >> 29;
+	result *= HASH_PRIME3;
+	result ^= result >> 32;
 	return result;
 }
+
+static inline void hash_init_lanes(uint64_t *lanes, uint64_t seed)
+{
+	lanes[0] = seed + HASH_PRIME1 + HASH_PRIME2;
+	lanes[1] = seed + HASH_PRIME2;
+	lanes[2] = seed;
+	lanes[3] = seed - HASH_PRIME1;
+}
+
+uint64_t compute_hash(const void *data, size_t size, uint64_t seed)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	uint64_t lanes[4];
+	hash_init_lanes(lanes, seed);
+	size_t done = hash_stripes(lanes, bytes, size);
+	return hash_finish(lanes, bytes + done, size - done, size, seed);
+}
+
+wfHashState::wfHashState(uint64_t seed): tail_size(0), total_size(0), seed(seed)
+{
+	hash_init_lanes(lanes, seed);
+}
+
+void wfHashState::update(const void *data, size_t size)
+{
+	const uint8_t *bytes = (const uint8_t *)data;
+	total_size += size;
+	// Complete stripe left over from previous update
+	if (tail_size != 0)
+	{
+		size_t fill = min(size, (size_t)(32 - tail_size));
+		memcpy(tail + tail_size, bytes, fill);
+		tail_size += fill;
+		bytes += fill;
+		size -= fill;
+		if (tail_size < 32)
+			return;
+		hash_stripes(lanes, tail, 32);
+		tail_size = 0;
+	}
+	size_t done = hash_stripes(lanes, bytes, size);
+	tail_size = size - done;
+	if (tail_size != 0)
+		memcpy(tail, bytes + done, tail_size);
+}
+
+uint64_t wfHashState::digest() const
+{
+	return hash_finish(lanes, tail, tail_size, total_size, seed);
+}
@@ -5,7 +5,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <atomic>
+#include <mutex>
 #include <vector>
+#include <list>
+#include <map>
+#include <set>
+#include <unordered_map>
 #include "wad_lump_types.h"
 #include "wad_structs.h"
 
@@ -15,16 +21,153 @@ using namespace std;
 // Internal lump representation                                //
 // *********************************************************** //
 
-struct wfLump
+// Null-terminated copy of lump name, as returned by get_lump_name
+struct wfLumpName
 {
-	string name;
-	int source_file_pos;
-	int size;
-	char *data;
+	char str[9];
+};
+
+enum wfLumpFlags
+{
+	LS_DELETED = 1,
+	LS_DONT_FREE = 2,
+	LS_MAPPED = 4,
+	LS_IN_BLOCK = 8, // Data point into a map block buffer
+	LS_MODIFIED = 16, // Data changed in memory, never evicted
+	LS_ARENA = 32, // Data allocated by alloc_lump_buffer from arena
+	LS_SHARED = 64, // Data allocated by alloc_lump_buffer, reference counted
+	LS_NOT_OWNED = LS_DONT_FREE | LS_MAPPED | LS_IN_BLOCK | LS_ARENA | LS_SHARED
+};
+
+// Range of lump positions [start, end)
+struct wfLumpRange
+{
+	int32_t start;
+	int32_t end;
+};
+
+#define WF_NUM_LUMP_TYPES (LT_IMAGE_FLAT + 1)
+
+// Slot of lump name index: first and last lump with the same name
+struct wfNameSlot
+{
+	int32_t first; // -1 if slot is empty
+	int32_t last;
+};
+
+// Source of lump which is not stored uncompressed in the file (pk3 only)
+struct wfPackedLump
+{
+	uint32_t data_pos; // Position of deflated data in source file
+	uint32_t packed_size;
+	uint32_t crc32; // Of unpacked data, so that it can be copied to another pk3
+	int32_t nested_wad; // Or index of deflated nested wad holding the lump, if not -1
+	uint32_t nested_pos; // Position of lump data in nested wad
+};
+
+// Deflated wad inside pk3, inflated whole on first access to any of its lumps
+struct wfNestedWad
+{
+	uint32_t data_pos;
+	uint32_t packed_size;
+	uint32_t size;
+	char *data; // NULL until inflated
+};
+
+// *********************************************************** //
+// Flags for loading wad file                                  //
+// *********************************************************** //
+
+enum wfLoadFlags
+{
+	// Map the whole file into memory. get_lump_data returns pointers
+	// directly into the mapping, which is private (copy-on-write),
+	// so tools may still modify returned lump data in place.
+	LF_MMAP = 1,
+	// Use cached lump directory and types if the wad file did not change.
+	// Cache is stored in directory given by WADUTILS_INDEX_CACHE env variable.
+	LF_INDEX_CACHE = 2
+};
+
+// *********************************************************** //
+// Options for saving wad file                                 //
+// *********************************************************** //
+
+struct wfSaveOptions
+{
+	// Store identical lumps only once and point all their directory entries to it
+	bool deduplicate;
+	// Align start of lump data to multiple of this value (0 or 1 = no alignment)
+	int alignment;
+	// Store data of each map and of each namespace (i.e. all flats) contiguously,
+	// regardless of directory order. Order is: other lumps, maps, namespaces.
+	bool group_lumps;
+	// With group_lumps, align only first lump of each map and namespace
+	bool align_groups_only;
+	// Number of threads writing lump data concurrently
+	int num_threads;
+	// Write header, lumps and directory strictly in file order, so that
+	// output can go into a pipe. Implied for standard output and pipes.
+	bool streaming;
+	// Write IWAD identification instead of PWAD
+	bool iwad;
+
+	wfSaveOptions(): deduplicate(false), alignment(0), group_lumps(false), align_groups_only(false), num_threads(1), streaming(false), iwad(false) {}
+};
+
+struct wfSaveLayout;
+struct wfPk3Entry;
+
+// *********************************************************** //
+// Lump filters for iterating over lumps                       //
+// *********************************************************** //
+
+enum wfLumpFilterKind
+{
+	LFK_ALL,
+	LFK_TYPE, // Lumps of given type, including namespace types (i.e. LT_IMAGE_FLAT)
+	LFK_NAME, // Lumps with given name (packed by pack_name)
+	LFK_NONE
+};
+
+struct wfLumpFilter
+{
+	int kind;
 	int type;
-	int subtype;
-	bool deleted;
-	bool dont_free;
+	uint64_t name;
+};
+
+class wfLumpList;
+
+// *********************************************************** //
+// Lump manifest for detecting changes between wad versions    //
+// *********************************************************** //
+
+struct wfManifestEntry
+{
+	uint64_t name;
+	uint64_t map_name; // Name of map header, if lump belongs to a map
+	uint64_t hash; // compute_hash of lump contents
+	uint32_t size;
+	uint32_t file_pos;
+};
+
+// One entry per directory entry, in directory order
+typedef vector<wfManifestEntry> wfManifest;
+
+enum wfManifestChangeFlags
+{
+	MC_ADDED = 1,
+	MC_REMOVED = 2,
+	MC_CHANGED = 4, // Contents differ
+	MC_MOVED = 8 // Order relative to other lumps differs
+};
+
+struct wfManifestChange
+{
+	int flags;
+	int old_pos; // -1 for added lump
+	int new_pos; // -1 for removed lump
 };
 
 // *********************************************************** //
@@ -34,18 +177,118 @@ struct wfLump
 class WadFile
 {
 private:
-	FILE *source_file;
+	int source_fd;
+	string source_filename;
 	bool update_mode;
-	vector<wfLump> lumps;
+	int load_flags;
+	char *mapping;
+	size_t mapping_size;
+	// Lump directory stored as parallel arrays indexed by lump position
+	vector<uint64_t> lump_names; // Packed by pack_name
+	vector<wfLumpName> lump_name_strs;
+	vector<uint32_t> lump_file_pos; // Zero if lump is not contained in source file
+	vector<uint32_t> lump_sizes;
+	vector<char *> lump_data;
+	vector<uint8_t> lump_types;
+	vector<uint8_t> lump_subtypes;
+	vector<uint8_t> lump_flags;
+	// Ranges of lumps of each namespace type and ranges of whole maps
+	vector<wfLumpRange> lump_ranges[WF_NUM_LUMP_TYPES];
+	// Lump name index: hash table with open addressing, one slot per distinct
+	// name. Lumps with the same name are linked in directory order.
+	vector<wfNameSlot> name_slots;
+	int num_names;
+	vector<int32_t> next_same_name; // Next lump with the same name, or -1
+	// Buffers holding whole map blocks, by position of map header lump
+	map<int, char *> map_blocks;
+	// Clean lumps loaded from file which can be evicted, most recently used first
+	list<int> cached_lumps;
+	unordered_map<int, list<int>::iterator> cached_lump_pos;
+	size_t cached_data_size;
+	size_t data_budget;
+	// Buffers allocated by alloc_lump_buffer: arena chunks holding small
+	// buffers and large buffers with number of lumps using them
+	set<char *> arena_chunks;
+	char *arena_last_chunk;
+	size_t arena_chunk_used;
+	unordered_map<char *, int> shared_buffers;
+	// Pk3 file: lumps which need unpacking and deflated nested wads. Nested
+	// wads are inflated on demand, also by const reads from multiple threads.
+	bool is_pk3;
+	unordered_map<int, wfPackedLump> packed_lumps;
+	mutable vector<wfNestedWad> nested_wads;
+	mutable mutex nested_wads_mutex;
+	// Wad file has IWAD identification
+	bool is_iwad;
 	int cursor_pos;
+	// Total time spent waiting for reads from source file, in nanoseconds
+	mutable atomic<int64_t> io_wait_ns;
+	// Bytes saved by deduplication during last save
+	int dedup_saved_bytes;
+
+	bool is_valid_pos(int lump_pos) const {return lump_pos >= 0 && lump_pos < (signed)lump_names.size();}
+	void resize_lump_directory(int num_lumps);
+	void index_lump_names();
+	void add_name_index(int lump_pos);
+	unsigned int find_name_slot(uint64_t name) const;
+	const wfNameSlot *find_name(uint64_t name) const;
+	bool read_lump_directory(const wadinfo_t &header);
+	void detect_lump_types();
+	void add_lump_range(int type, int lump_pos);
+	bool load_index_cache(const wadinfo_t &header);
+	void save_index_cache(const wadinfo_t &header);
+	const char *get_lump_contents(int lump_pos, vector<char> &buffer) const;
+	void uncache_lump(int lump_pos);
+	void evict_cached_lumps(size_t needed);
+	void add_cached_lump(int lump_pos);
+	bool read_source_data(char *buffer, uint32_t size, uint32_t pos) const;
+	int64_t read_source(char *buffer, size_t size, int64_t pos) const;
+	uint32_t get_map_block_span(int map_lump_pos, bool unloaded_only, uint32_t &block_start, uint32_t &block_end) const;
+	bool read_map_block(int map_lump_pos);
+	bool read_pk3_directory();
+	void add_pk3_lump(const char *name, uint32_t file_pos, uint32_t size);
+	bool add_pk3_nested_wad(const char *name, uint32_t data_pos, uint32_t packed_size, uint32_t size, bool deflated);
+	bool inflate_packed_lump(const wfPackedLump &packed, char *buffer, uint32_t size, uint32_t offset = 0) const;
+	const char *get_nested_wad_data(int nested_wad) const;
+	int read_packed_lump_part(const wfPackedLump &packed, char *buffer, int offset, int size) const;
+	char *load_packed_lump(int lump_pos);
+	bool pack_pk3_entry(wfPk3Entry &entry, int level) const;
+	bool is_arena_buffer(char *data) const;
+	void set_lump_buffer(int lump_pos, char *data, bool nofree);
+	void release_shared_buffer(char *data);
+	bool plan_save_layout(const wfSaveOptions &options, wfSaveLayout &layout);
 
 public:
-	WadFile(): source_file(NULL), update_mode(false), cursor_pos(-1) {};
+	WadFile(): source_fd(-1), update_mode(false), load_flags(0), mapping(NULL), mapping_size(0), num_names(0), cached_data_size(0), data_budget(0), arena_last_chunk(NULL), arena_chunk_used(0), is_pk3(false), is_iwad(false), cursor_pos(-1), io_wait_ns(0), dedup_saved_bytes(0) {};
 
 	~WadFile();
 
-	bool load_wad_file(const char* filename, bool update = false);
-	bool save_wad_file(const char* filename, bool drop_contents = true);
+	// Load wad or pk3 file. Files in pk3 become lumps named after the file,
+	// folders flats/, sprites/, patches/ and textures/ act as namespaces and
+	// lumps of wads in maps/ folder are included as if they were in the pk3.
+	// Pk3 files cannot be updated.
+	bool load_wad_file(const char* filename, bool update = false, int flags = 0);
+	bool is_pk3_file() const {return is_pk3;}
+	bool is_iwad_file() const {return is_iwad;}
+	// Save wad file. Filename "-" means standard output.
+	bool save_wad_file(const char* filename, bool drop_contents = true, const wfSaveOptions &options = wfSaveOptions());
+	// Save lumps as pk3 file. Namespace lumps go to their folders, each map
+	// is saved as a wad in maps/ folder and markers are left out. Entries
+	// are compressed by options.num_threads threads and stored uncompressed
+	// if it does not pay off. Unchanged deflated files of pk3 are copied as is.
+	bool save_pk3_file(const char* filename, bool drop_contents = true, const wfSaveOptions &options = wfSaveOptions());
+	int get_dedup_saved_bytes() const {return dedup_saved_bytes;}
+	// Time in seconds spent waiting for lumps to be read from the file
+	double get_io_wait_time() const {return io_wait_ns / 1e9;}
+	void close_wad_file();
+
+	// Save changes into the wad file opened in update mode. New and resized
+	// lumps and the new directory are appended at the end of the file, other
+	// loaded lumps are written in place. Old copies remain as dead space
+	// until compact_wad_file rewrites the file and loads it again
+	// (positions of lumps change if any were deleted).
+	bool save_wad_file_incremental(bool drop_contents = true);
+	bool compact_wad_file();
 
 	bool save_lump_into_file(int lump_pos);
 
@@ -53,13 +296,82 @@ public:
 
 	int find_lump_by_name(const string &name);
 	int find_next_lump_by_name(const string &name);
+	int find_last_lump_by_name(const string &name) const;
 	int find_next_lump_by_type(int type);
 
-	vector<wfLump> &get_all_lumps() {return lumps;}
-	const char *get_lump_name(int lump_pos);
-	int get_lump_size(int lump_pos);
+	// Cursor-free lookup, returns first matching lump after given position.
+	// Use -1 as position to search from beginning.
+	int find_lump_by_name_after(const string &name, int lump_pos) const;
+	int find_lump_by_type_after(int type, int lump_pos) const;
+	int find_lump_after(const wfLumpFilter &filter, int lump_pos) const;
+
+	// Lumps of given type or name, for use in range-based for loop:
+	//   for (int map_lump_pos : wadfile.lumps_by_type(LT_MAP_HEADER))
+	// Each list has its own position, so loops can be nested or run
+	// concurrently. Next lump is searched only when the loop advances,
+	// so lumps appended meanwhile are visited too.
+	wfLumpList all_lumps() const;
+	wfLumpList lumps_by_type(int type) const;
+	wfLumpList lumps_by_name(const string &name) const;
+	// Ranges of lumps of namespace type (i.e. LT_IMAGE_FLAT) in directory order,
+	// recorded when the wad is loaded. For LT_MAP_HEADER, ranges of whole maps
+	// starting with map header. Other types have no ranges.
+	const vector<wfLumpRange> &get_lump_ranges(int type) const;
+
+	int get_num_lumps() const {return lump_names.size();}
+	const char *get_lump_name(int lump_pos) const;
+	// Size and position of lump in source file, zero for invalid lump
+	uint32_t get_lump_size(int lump_pos) const;
+	uint32_t get_lump_file_pos(int lump_pos) const;
+	// Load lump data if not loaded yet. Different lumps can be loaded
+	// from multiple threads at once, as long as no lump is appended,
+	// replaced or dropped meanwhile and no data budget is set.
 	char *get_lump_data(int lump_pos);
-	int get_lump_subtype(int lump_pos);
+	// Limit total size of clean lump data loaded from file after this call
+	// (0 = no limit). Least recently used lumps are dropped when loading another one would
+	// exceed the budget and are loaded again on next get_lump_data, so
+	// pointers to clean lumps may become invalid by loading other lumps.
+	// Modified lumps, lumps with nofree data and map blocks are never dropped.
+	void set_lump_data_budget(size_t bytes);
+	size_t get_cached_data_size() const {return cached_data_size;}
+	// Mark lump data as modified in place, so that it is never evicted
+	void mark_lump_modified(int lump_pos);
+	// Read lump contents into given buffer (at least lump size bytes big).
+	// Does not change any state, so it can be called from multiple threads.
+	bool read_lump_data(int lump_pos, char *buffer) const;
+	// Read only given byte range of lump contents, i.e. just a header.
+	// Returns number of bytes read, which is less than size if the range
+	// exceeds the lump, or -1 on error.
+	int read_lump_part(int lump_pos, char *buffer, int offset, int size) const;
+	int get_lump_type(int lump_pos) const;
+	int get_lump_subtype(int lump_pos) const;
+
+	// Number of lumps following map header which belong to the map
+	int get_map_lump_count(int map_lump_pos) const;
+	// Read all lumps of a map in a single read, if they are stored next
+	// to each other in the file. get_lump_data then returns pointers into
+	// the common buffer, which is freed by drop_map_block or destructor.
+	// In mapped file the pages of the map are faulted in instead.
+	// The next map is prefetched in background meanwhile.
+	bool load_map_block(int map_lump_pos);
+	// Hint the system to start reading lumps of a map in background
+	void prefetch_map_block(int map_lump_pos) const;
+	// Free the common buffer. Lumps modified in place are moved to own buffers.
+	void drop_map_block(int map_lump_pos);
+
+	// Hash contents of all lumps, each lump is read once
+	bool build_manifest(wfManifest &manifest) const;
+
+	// Allocate zero-filled buffer owned by this wad, for building new lump
+	// contents. Pass it to replace_lump_data or append_lump (nofree is then
+	// ignored); the same buffer may back several lumps. Small buffers come
+	// from an arena, large ones are freed once no lump uses them anymore.
+	// All buffers are freed together when the wad is closed.
+	char *alloc_lump_buffer(size_t size);
+	// Get lump data in a buffer with reference count owned by this wad, so
+	// that it can be passed to another lump by replace_lump_data or
+	// append_lump. The buffer is freed once no lump uses it.
+	char *share_lump_data(int lump_pos);
 
 	void replace_lump_data(int lump_pos, char *data, int size, bool nofree);
 	void update_lump_data(int lump_pos);
@@ -69,6 +381,39 @@ public:
 	void append_lump(string name, int size, char *data, int type, int subtype, bool nofree);
 };
 
+// *********************************************************** //
+// Lump iterator and list                                      //
+// *********************************************************** //
+
+class wfLumpIterator
+{
+private:
+	const WadFile *wadfile;
+	wfLumpFilter filter;
+	int lump_pos;
+
+public:
+	wfLumpIterator(const WadFile *wadfile, const wfLumpFilter &filter, int lump_pos): wadfile(wadfile), filter(filter), lump_pos(lump_pos) {};
+
+	int operator*() const {return lump_pos;}
+	wfLumpIterator &operator++() {lump_pos = wadfile->find_lump_after(filter, lump_pos); return *this;}
+	bool operator==(const wfLumpIterator &other) const {return lump_pos == other.lump_pos;}
+	bool operator!=(const wfLumpIterator &other) const {return lump_pos != other.lump_pos;}
+};
+
+class wfLumpList
+{
+private:
+	const WadFile *wadfile;
+	wfLumpFilter filter;
+
+public:
+	wfLumpList(const WadFile *wadfile, const wfLumpFilter &filter): wadfile(wadfile), filter(filter) {};
+
+	wfLumpIterator begin() const {return wfLumpIterator(wadfile, filter, wadfile->find_lump_after(filter, -1));}
+	wfLumpIterator end() const {return wfLumpIterator(wadfile, filter, -1);}
+};
+
 // *********************************************************** //
 // Frequently used auxiliary functions                         //
 // *********************************************************** //
@@ -80,6 +425,55 @@ static inline string extract_name(char *name)
 	return string(tmp);
 }
 
-uint32_t compute_hash(uint8_t *data, int size);
+static inline uint64_t pack_name(const char *name)
+{
+	char tmp[8] = {0};
+	strncpy(tmp, name, 8);
+	uint64_t result;
+	memcpy(&result, tmp, 8);
+	return result;
+}
+
+// Read 32-bit value from lump data, which need not be aligned (i.e. in mapped file)
+static inline uint32_t read_le32(const char *data)
+{
+	uint32_t result;
+	memcpy(&result, data, 4);
+	return result;
+}
+
+// 64-bit hash of given data, processed a word at a time
+uint64_t compute_hash(const void *data, size_t size, uint64_t seed = 0);
+
+// Incremental variant of compute_hash, for data which is fed in parts.
+// Gives the same result as compute_hash over concatenation of all parts.
+struct wfHashState
+{
+	uint64_t lanes[4];
+	uint8_t tail[32];
+	uint32_t tail_size;
+	uint64_t total_size;
+	uint64_t seed;
+
+	wfHashState(uint64_t seed = 0);
+	void update(const void *data, size_t size);
+	uint64_t digest() const;
+};
+
+// Write whole data at given position of file, or at current position if pos is -1
+bool write_all(int fd, const char *data, size_t size, int64_t pos = -1);
+// Copy part of source file to target file at given position (or current
+// position if dst_pos is -1), inside the kernel where possible
+bool copy_file_data(int src_fd, int64_t src_pos, int dst_fd, int64_t dst_pos, size_t size);
+
+// Store manifest into file and load it back
+bool save_manifest(const char *filename, const wfManifest &manifest);
+bool load_manifest(const char *filename, wfManifest &manifest);
+// Compare manifests of two wad versions without reading any lump data.
+// Lumps are matched by name, map they belong to and order of occurrence.
+// Reports only lumps which were added, removed, changed or moved; changes
+// of added, changed and moved lumps come in new directory order, followed
+// by removed lumps in old directory order.
+void diff_manifest(const wfManifest &old_manifest, const wfManifest &new_manifest, vector<wfManifestChange> &changes);
 
 #endif // WAD_FILE_H
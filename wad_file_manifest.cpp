@@ -0,0 +1,195 @@
+#include "wad_file.h"
+
+// *********************************************************** //
+// Lump manifest                                               //
+// *********************************************************** //
+
+#define MANIFEST_VERSION 1
+
+struct wfManifestHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t num_entries;
+	uint32_t reserved;
+};
+
+bool WadFile::build_manifest(wfManifest &manifest) const
+{
+	// Name of map which each lump belongs to
+	vector<uint64_t> map_names(lump_names.size(), 0);
+	const vector<wfLumpRange> &maps = lump_ranges[LT_MAP_HEADER];
+	for (unsigned int m = 0; m < maps.size(); m++)
+		for (int i = maps[m].start + 1; i < maps[m].end; i++)
+			map_names[i] = lump_names[maps[m].start];
+	// Hash contents of all lumps which would be saved
+	manifest.clear();
+	manifest.reserve(lump_names.size());
+	vector<char> buffer;
+	for (unsigned int i = 0; i < lump_names.size(); i++)
+	{
+		if (lump_flags[i] & LS_DELETED)
+			continue;
+		const char *data = get_lump_contents(i, buffer);
+		if (data == NULL)
+			return false;
+		wfManifestEntry entry;
+		entry.name = lump_names[i];
+		entry.map_name = map_names[i];
+		entry.hash = compute_hash(data, lump_sizes[i]);
+		entry.size = lump_sizes[i];
+		entry.file_pos = lump_file_pos[i];
+		manifest.push_back(entry);
+	}
+	return true;
+}
+
+bool save_manifest(const char *filename, const wfManifest &manifest)
+{
+	FILE *file = fopen(filename, "wb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Failed to open file for write %s\n",filename);
+		return false;
+	}
+	wfManifestHeader header;
+	memcpy(header.magic, "WFMF", 4);
+	header.version = MANIFEST_VERSION;
+	header.num_entries = manifest.size();
+	header.reserved = 0;
+	bool result = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		(manifest.empty() || fwrite(&manifest[0], sizeof(wfManifestEntry), manifest.size(), file) == manifest.size());
+	if (fclose(file) != 0)
+		result = false;
+	if (!result)
+		fprintf(stderr, "Failed to write file %s\n",filename);
+	return result;
+}
+
+bool load_manifest(const char *filename, wfManifest &manifest)
+{
+	manifest.clear();
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL)
+		return false;
+	wfManifestHeader header;
+	bool valid = fread(&header, sizeof(header), 1, file) == 1 &&
+		strncmp(header.magic, "WFMF", 4) == 0 &&
+		header.version == MANIFEST_VERSION;
+	if (valid && header.num_entries != 0)
+	{
+		// Check number of entries against file size before allocating them
+		fseek(file, 0, SEEK_END);
+		valid = (uint64_t)ftell(file) == sizeof(header) + (uint64_t)header.num_entries * sizeof(wfManifestEntry);
+		fseek(file, sizeof(header), SEEK_SET);
+		if (valid)
+		{
+			manifest.resize(header.num_entries);
+			valid = fread(&manifest[0], sizeof(wfManifestEntry), header.num_entries, file) == header.num_entries;
+		}
+	}
+	fclose(file);
+	if (!valid)
+	{
+		fprintf(stderr, "File %s is not a valid manifest file.\n",filename);
+		manifest.clear();
+	}
+	return valid;
+}
+
+// Lumps are matched by name together with name of map they belong to
+typedef pair<uint64_t, uint64_t> wfManifestKey;
+
+struct wfManifestKeyHash
+{
+	size_t operator()(const wfManifestKey &key) const
+	{
+		return compute_hash(&key, sizeof(key));
+	}
+};
+
+// Old positions of lumps with the same key, and how many were matched so far
+struct wfManifestMatches
+{
+	vector<int> old_pos;
+	unsigned int matched;
+};
+
+void diff_manifest(const wfManifest &old_manifest, const wfManifest &new_manifest, vector<wfManifestChange> &changes)
+{
+	changes.clear();
+	unordered_map<wfManifestKey, wfManifestMatches, wfManifestKeyHash> matches;
+	matches.reserve(old_manifest.size());
+	for (unsigned int i = 0; i < old_manifest.size(); i++)
+	{
+		wfManifestMatches &m = matches[wfManifestKey(old_manifest[i].name, old_manifest[i].map_name)];
+		if (m.old_pos.empty())
+			m.matched = 0;
+		m.old_pos.push_back(i);
+	}
+	// Match n-th occurrence of a key in new manifest with n-th occurrence in old one
+	vector<int> new_to_old(new_manifest.size(), -1);
+	vector<bool> old_matched(old_manifest.size(), false);
+	for (unsigned int i = 0; i < new_manifest.size(); i++)
+	{
+		unordered_map<wfManifestKey, wfManifestMatches, wfManifestKeyHash>::iterator it =
+			matches.find(wfManifestKey(new_manifest[i].name, new_manifest[i].map_name));
+		if (it == matches.end() || it->second.matched == it->second.old_pos.size())
+			continue;
+		new_to_old[i] = it->second.old_pos[it->second.matched++];
+		old_matched[new_to_old[i]] = true;
+	}
+	// Matched lumps which keep their relative order form the longest increasing
+	// subsequence of old positions (in new order), all others were moved
+	vector<int> tails; // Index of last new lump of increasing subsequence of each length
+	vector<int> prev(new_manifest.size(), -1);
+	for (unsigned int i = 0; i < new_manifest.size(); i++)
+	{
+		if (new_to_old[i] == -1)
+			continue;
+		int low = 0;
+		int high = tails.size();
+		while (low < high)
+		{
+			int mid = (low + high) / 2;
+			if (new_to_old[tails[mid]] < new_to_old[i])
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		prev[i] = (low > 0) ? tails[low - 1] : -1;
+		if (low == (int)tails.size())
+			tails.push_back(i);
+		else
+			tails[low] = i;
+	}
+	vector<bool> in_order(new_manifest.size(), false);
+	for (int i = tails.empty() ? -1 : tails.back(); i != -1; i = prev[i])
+		in_order[i] = true;
+	// Report changes of new lumps
+	for (unsigned int i = 0; i < new_manifest.size(); i++)
+	{
+		wfManifestChange change = {0, new_to_old[i], (int)i};
+		if (change.old_pos == -1)
+			change.flags = MC_ADDED;
+		else
+		{
+			const wfManifestEntry &old_entry = old_manifest[change.old_pos];
+			if (old_entry.hash != new_manifest[i].hash || old_entry.size != new_manifest[i].size)
+				change.flags |= MC_CHANGED;
+			if (!in_order[i])
+				change.flags |= MC_MOVED;
+		}
+		if (change.flags)
+			changes.push_back(change);
+	}
+	// Report removed lumps
+	for (unsigned int i = 0; i < old_manifest.size(); i++)
+	{
+		if (!old_matched[i])
+		{
+			wfManifestChange change = {MC_REMOVED, (int)i, -1};
+			changes.push_back(change);
+		}
+	}
+}
@@ -0,0 +1,614 @@
+#include "wad_file.h"
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <time.h>
+#include <ctype.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+// *********************************************************** //
+// Pk3 (zip) file reading                                      //
+// *********************************************************** //
+
+// Lump types of files in pk3 folders acting as namespaces
+struct wfPk3Namespace
+{
+	const char *folder;
+	int type;
+};
+
+static const wfPk3Namespace wfPk3Namespaces[] =
+{
+	{"sprites", LT_IMAGE_SPRITE},
+	{"textures", LT_IMAGE_TEXTURE},
+	{"patches", LT_IMAGE_PATCH},
+	{"flats", LT_IMAGE_FLAT},
+	{NULL, LT_UNKNOWN}
+};
+
+// Lump name is file name without path and extension, in upper case
+static void get_pk3_lump_name(const string &filename, char *name)
+{
+	size_t start = filename.rfind('/');
+	start = (start == string::npos) ? 0 : start + 1;
+	memset(name, 0, 9);
+	for (int i = 0; i < 8 && start + i < filename.size() && filename[start + i] != '.'; i++)
+		name[i] = toupper(filename[start + i]);
+}
+
+bool WadFile::read_pk3_directory()
+{
+	// Find end of central directory record, which may be followed by comment
+	struct stat st;
+	if (fstat(source_fd, &st) != 0 || st.st_size < (signed)sizeof(zip_end_record_t))
+		return false;
+	// Positions in zip without ZIP64 extension are 32-bit
+	if ((uint64_t)st.st_size > 0xFFFFFFFF)
+	{
+		fprintf(stderr, "Pk3 file %s is larger than 4 GB, which is not supported.\n", source_filename.c_str());
+		return false;
+	}
+	uint32_t file_size = st.st_size;
+	uint32_t tail_size = min(file_size, (uint32_t)(sizeof(zip_end_record_t) + 0xFFFF));
+	vector<char> tail(tail_size);
+	if (!read_source_data(&tail[0], tail_size, file_size - tail_size))
+		return false;
+	zip_end_record_t end_record;
+	int end_pos;
+	for (end_pos = tail_size - sizeof(zip_end_record_t); end_pos >= 0; end_pos--)
+	{
+		memcpy(&end_record, &tail[end_pos], sizeof(zip_end_record_t));
+		if (end_record.signature == ZIP_END_RECORD_SIG)
+			break;
+	}
+	if (end_pos < 0 || end_record.disk_num != 0 || (uint64_t)end_record.directory_pos + end_record.directory_size > file_size)
+		return false;
+
+	// Read whole central directory
+	vector<char> directory(end_record.directory_size + 1);
+	if (!read_source_data(&directory[0], end_record.directory_size, end_record.directory_pos))
+		return false;
+	resize_lump_directory(0);
+	vector<uint8_t> folder_types;
+	// Nested wads which may contain a map, by position of their first lump
+	vector<pair<int, string> > nested_starts;
+	uint32_t entry_pos = 0;
+	for (int n = 0; n < end_record.total_entries; n++)
+	{
+		zip_central_header_t entry;
+		if (entry_pos + sizeof(zip_central_header_t) > end_record.directory_size)
+			return false;
+		memcpy(&entry, &directory[entry_pos], sizeof(zip_central_header_t));
+		if (entry.signature != ZIP_CENTRAL_HEADER_SIG || entry_pos + sizeof(zip_central_header_t) + entry.name_length > end_record.directory_size)
+			return false;
+		string filename(&directory[entry_pos + sizeof(zip_central_header_t)], entry.name_length);
+		entry_pos += sizeof(zip_central_header_t) + entry.name_length + entry.extra_length + entry.comment_length;
+		// Skip folders
+		if (filename.empty() || filename[filename.size() - 1] == '/')
+			continue;
+		// Only stored and deflated files can be read
+		if ((entry.flags & 1) || (entry.method != 0 && entry.method != Z_DEFLATED))
+		{
+			fprintf(stderr, "Skipping encrypted or unsupported file %s in %s\n", filename.c_str(), source_filename.c_str());
+			continue;
+		}
+		// File data follow local header, whose extra field may differ from central one
+		zip_local_header_t local_header;
+		if (!read_source_data((char *)&local_header, sizeof(zip_local_header_t), entry.local_header_pos) || local_header.signature != ZIP_LOCAL_HEADER_SIG)
+			return false;
+		uint64_t data_pos = (uint64_t)entry.local_header_pos + sizeof(zip_local_header_t) + local_header.name_length + local_header.extra_length;
+		if (data_pos + entry.packed_size > file_size)
+			return false;
+		bool deflated = entry.method == Z_DEFLATED;
+		// Folder in pk3 root determines the namespace
+		string folder;
+		size_t slash = filename.find('/');
+		if (slash != string::npos)
+			folder = filename.substr(0, slash);
+		transform(folder.begin(), folder.end(), folder.begin(), ::tolower);
+		char name[9];
+		get_pk3_lump_name(filename, name);
+		// Wads inside maps folder
+		string extension = filename.substr(filename.rfind('.') == string::npos ? filename.size() : filename.rfind('.'));
+		transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+		if (folder == "maps" && extension == ".wad")
+		{
+			int first_lump = lump_names.size();
+			if (add_pk3_nested_wad(filename.c_str(), data_pos, entry.packed_size, entry.size, deflated))
+			{
+				nested_starts.push_back(make_pair(first_lump, string(name)));
+				folder_types.resize(lump_names.size(), LT_UNKNOWN);
+				continue;
+			}
+		}
+		int type = LT_UNKNOWN;
+		for (int i = 0; wfPk3Namespaces[i].folder; i++)
+			if (folder == wfPk3Namespaces[i].folder)
+				type = wfPk3Namespaces[i].type;
+		folder_types.push_back(type);
+		if (!deflated)
+		{
+			// Stored file is read directly from pk3 like a wad lump
+			add_pk3_lump(name, entry.size ? data_pos : 0, entry.size);
+		}
+		else
+		{
+			add_pk3_lump(name, 0, entry.size);
+			wfPackedLump packed = {(uint32_t)data_pos, entry.packed_size, entry.crc32, -1, 0};
+			if (entry.size)
+				packed_lumps[lump_names.size() - 1] = packed;
+		}
+	}
+
+	// Detect lump types as in wad file, files in namespace folders need no markers
+	detect_lump_types();
+	for (unsigned int i = 0; i < folder_types.size(); i++)
+		if (lump_types[i] == LT_UNKNOWN)
+			lump_types[i] = folder_types[i];
+	// Namespace ranges then include lumps from both markers and folders
+	for (int t = LT_IMAGE_SPRITE; t <= LT_IMAGE_FLAT; t++)
+		lump_ranges[t].clear();
+	for (unsigned int i = 0; i < lump_types.size(); i++)
+		if (lump_types[i] >= LT_IMAGE_SPRITE && lump_types[i] <= LT_IMAGE_FLAT)
+			add_lump_range(lump_types[i], i);
+	// Map in nested wad is named after the wad
+	for (unsigned int i = 0; i < nested_starts.size(); i++)
+		if (lump_types[nested_starts[i].first] == LT_MAP_HEADER)
+			lump_names[nested_starts[i].first] = pack_name(nested_starts[i].second.c_str());
+	index_lump_names();
+	return true;
+}
+
+void WadFile::add_pk3_lump(const char *name, uint32_t file_pos, uint32_t size)
+{
+	lump_names.push_back(pack_name(name));
+	lump_name_strs.push_back(wfLumpName());
+	lump_file_pos.push_back(file_pos);
+	lump_sizes.push_back(size);
+	lump_data.push_back(NULL);
+	lump_types.push_back(LT_UNKNOWN);
+	lump_subtypes.push_back(0);
+	lump_flags.push_back(0);
+}
+
+// Add all lumps of wad stored in pk3. Lumps of stored wad are read directly
+// from the pk3. Of deflated wad only header and directory are inflated now,
+// whole wad is inflated on first access to any of its lumps.
+bool WadFile::add_pk3_nested_wad(const char *name, uint32_t data_pos, uint32_t packed_size, uint32_t size, bool deflated)
+{
+	wfPackedLump packed = {data_pos, packed_size, 0, -1, 0};
+	// Read and check header and directory
+	wadinfo_t header;
+	bool valid = size >= sizeof(wadinfo_t);
+	if (valid && deflated)
+		valid = inflate_packed_lump(packed, (char *)&header, sizeof(wadinfo_t));
+	else if (valid)
+		valid = read_source_data((char *)&header, sizeof(wadinfo_t), data_pos);
+	valid = valid && (!strncmp(header.identification, "PWAD", 4) || !strncmp(header.identification, "IWAD", 4)) &&
+		(uint64_t)header.infotableofs + (uint64_t)header.numnlumps * sizeof(filelump_t) <= size;
+	if (!valid)
+	{
+		fprintf(stderr, "File %s in %s is not a valid wad file.\n", name, source_filename.c_str());
+		return false;
+	}
+	vector<filelump_t> directory(header.numnlumps + 1);
+	if (deflated)
+	{
+		if (!inflate_packed_lump(packed, (char *)&directory[0], header.numnlumps * sizeof(filelump_t), header.infotableofs))
+		{
+			fprintf(stderr, "Failed to unpack %s in %s\n", name, source_filename.c_str());
+			return false;
+		}
+		wfNestedWad nested = {data_pos, packed_size, size, NULL};
+		nested_wads.push_back(nested);
+	}
+	else if (!read_source_data((char *)&directory[0], header.numnlumps * sizeof(filelump_t), data_pos + header.infotableofs))
+		return false;
+	for (unsigned int i = 0; i < header.numnlumps; i++)
+	{
+		char lump_name[9] = {0};
+		memcpy(lump_name, directory[i].name, 8);
+		uint32_t lump_size = directory[i].size;
+		if ((uint64_t)directory[i].filepos + lump_size > size)
+			lump_size = 0;
+		if (!deflated)
+			add_pk3_lump(lump_name, lump_size ? data_pos + directory[i].filepos : 0, lump_size);
+		else
+		{
+			add_pk3_lump(lump_name, 0, lump_size);
+			wfPackedLump nested_lump = {0, 0, 0, (int32_t)nested_wads.size() - 1, directory[i].filepos};
+			if (lump_size)
+				packed_lumps[lump_names.size() - 1] = nested_lump;
+		}
+	}
+	return true;
+}
+
+// Inflate size bytes from given offset of deflated pk3 file
+bool WadFile::inflate_packed_lump(const wfPackedLump &packed, char *buffer, uint32_t size, uint32_t offset) const
+{
+	// Compressed data are taken from mapped file or read from file
+	vector<char> input;
+	const char *input_data;
+	if (mapping && (size_t)packed.data_pos + packed.packed_size <= mapping_size)
+		input_data = mapping + packed.data_pos;
+	else
+	{
+		input.resize(packed.packed_size + 1);
+		if (!read_source_data(&input[0], packed.packed_size, packed.data_pos))
+			return false;
+		input_data = &input[0];
+	}
+	z_stream stream;
+	memset(&stream, 0, sizeof(z_stream));
+	if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+		return false;
+	stream.next_in = (Bytef *)input_data;
+	stream.avail_in = packed.packed_size;
+	// Data before the offset are inflated into scratch buffer and thrown away
+	char scratch[65536];
+	int result = Z_OK;
+	while (stream.total_out < offset && result == Z_OK)
+	{
+		stream.next_out = (Bytef *)scratch;
+		stream.avail_out = min((uint32_t)sizeof(scratch), offset - (uint32_t)stream.total_out);
+		result = inflate(&stream, Z_NO_FLUSH);
+	}
+	if (result == Z_OK)
+	{
+		stream.next_out = (Bytef *)buffer;
+		stream.avail_out = size;
+		result = inflate(&stream, Z_FINISH);
+	}
+	bool ok = (result == Z_STREAM_END || result == Z_BUF_ERROR || result == Z_OK) && stream.total_out == (uint64_t)offset + size;
+	inflateEnd(&stream);
+	return ok;
+}
+
+// Data of deflated nested wad, which is inflated on first access
+const char *WadFile::get_nested_wad_data(int nested_wad) const
+{
+	lock_guard<mutex> lock(nested_wads_mutex);
+	wfNestedWad &nested = nested_wads[nested_wad];
+	if (nested.data == NULL)
+	{
+		char *data = (char *)malloc(nested.size + 1);
+		wfPackedLump packed = {nested.data_pos, nested.packed_size, 0, -1, 0};
+		if (!inflate_packed_lump(packed, data, nested.size))
+		{
+			free(data);
+			fprintf(stderr, "Failed to unpack nested wad in %s\n", source_filename.c_str());
+			return NULL;
+		}
+		nested.data = data;
+	}
+	return nested.data;
+}
+
+int WadFile::read_packed_lump_part(const wfPackedLump &packed, char *buffer, int offset, int size) const
+{
+	if (packed.nested_wad != -1)
+	{
+		const char *nested_data = get_nested_wad_data(packed.nested_wad);
+		if (nested_data == NULL)
+			return -1;
+		memcpy(buffer, nested_data + packed.nested_pos + offset, size);
+		return size;
+	}
+	// Inflate only data up to end of requested part
+	return inflate_packed_lump(packed, buffer, size, offset) ? size : -1;
+}
+
+// Load lump of pk3 file which needs unpacking
+char *WadFile::load_packed_lump(int lump_pos)
+{
+	unordered_map<int, wfPackedLump>::iterator it = packed_lumps.find(lump_pos);
+	if (it == packed_lumps.end())
+		return NULL;
+	if (it->second.nested_wad != -1)
+	{
+		const char *nested_data = get_nested_wad_data(it->second.nested_wad);
+		if (nested_data == NULL)
+			return NULL;
+		lump_data[lump_pos] = (char *)nested_data + it->second.nested_pos;
+		lump_flags[lump_pos] |= LS_IN_BLOCK;
+		return lump_data[lump_pos];
+	}
+	uint32_t size = lump_sizes[lump_pos];
+	evict_cached_lumps(size);
+	char *data = (char *)malloc(size);
+	if (!inflate_packed_lump(it->second, data, size))
+	{
+		free(data);
+		return NULL;
+	}
+	lump_data[lump_pos] = data;
+	add_cached_lump(lump_pos);
+	return data;
+}
+
+// *********************************************************** //
+// Pk3 (zip) file writing                                      //
+// *********************************************************** //
+
+// Folders for lumps of namespace types, by lump type
+static const char *wfPk3TypeFolder(int type)
+{
+	for (int i = 0; wfPk3Namespaces[i].folder; i++)
+		if (wfPk3Namespaces[i].type == type)
+			return wfPk3Namespaces[i].folder;
+	return NULL;
+}
+
+// One file to be written into pk3
+struct wfPk3Entry
+{
+	string path;
+	// The lump, or map header followed by all map lumps for map wad
+	vector<int> lumps;
+	bool is_map;
+	// Contents prepared by pack_pk3_entry
+	vector<char> data;
+	uint32_t size;
+	uint32_t crc32;
+	uint16_t method;
+	bool ready;
+	bool ok;
+};
+
+// Prepare packed contents of entry. Only reads from wad, so it is
+// called from multiple threads at once.
+bool WadFile::pack_pk3_entry(wfPk3Entry &entry, int level) const
+{
+	int lump_pos = entry.lumps[0];
+	// Unchanged deflated file from source pk3 is copied as is
+	unordered_map<int, wfPackedLump>::const_iterator it = packed_lumps.find(lump_pos);
+	if (!entry.is_map && it != packed_lumps.end() && it->second.nested_wad == -1 && !(lump_flags[lump_pos] & LS_MODIFIED))
+	{
+		entry.size = lump_sizes[lump_pos];
+		entry.crc32 = it->second.crc32;
+		entry.method = Z_DEFLATED;
+		entry.data.resize(it->second.packed_size);
+		return entry.data.empty() || read_source_data(&entry.data[0], it->second.packed_size, it->second.data_pos);
+	}
+	// Gather unpacked contents: lump itself or whole map wad
+	vector<char> contents;
+	if (!entry.is_map)
+	{
+		contents.resize(lump_sizes[lump_pos]);
+		if (!contents.empty() && !read_lump_data(lump_pos, &contents[0]))
+			return false;
+	}
+	else
+	{
+		uint32_t directory_pos = sizeof(wadinfo_t);
+		for (unsigned int i = 0; i < entry.lumps.size(); i++)
+			directory_pos += lump_sizes[entry.lumps[i]];
+		contents.resize(directory_pos + sizeof(filelump_t) * entry.lumps.size());
+		wadinfo_t header;
+		memcpy(header.identification, "PWAD", 4);
+		header.numnlumps = entry.lumps.size();
+		header.infotableofs = directory_pos;
+		memcpy(&contents[0], &header, sizeof(wadinfo_t));
+		uint32_t cur_pos = sizeof(wadinfo_t);
+		for (unsigned int i = 0; i < entry.lumps.size(); i++)
+		{
+			int pos = entry.lumps[i];
+			filelump_t lump;
+			lump.filepos = cur_pos;
+			lump.size = lump_sizes[pos];
+			memcpy(lump.name, &lump_names[pos], 8);
+			memcpy(&contents[directory_pos + sizeof(filelump_t) * i], &lump, sizeof(filelump_t));
+			if (lump.size != 0 && !read_lump_data(pos, &contents[cur_pos]))
+				return false;
+			cur_pos += lump.size;
+		}
+	}
+	entry.size = contents.size();
+	entry.crc32 = crc32(0, (Bytef *)(contents.empty() ? NULL : &contents[0]), contents.size());
+	// Deflate the contents, but keep them stored if they do not get at least 1/16 smaller
+	entry.method = 0;
+	if (entry.size >= 64)
+	{
+		z_stream stream;
+		memset(&stream, 0, sizeof(z_stream));
+		if (deflateInit2(&stream, level, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return false;
+		entry.data.resize(deflateBound(&stream, entry.size));
+		stream.next_in = (Bytef *)&contents[0];
+		stream.avail_in = entry.size;
+		stream.next_out = (Bytef *)&entry.data[0];
+		stream.avail_out = entry.data.size();
+		int result = deflate(&stream, Z_FINISH);
+		deflateEnd(&stream);
+		if (result == Z_STREAM_END && stream.total_out < entry.size - entry.size / 16)
+		{
+			entry.data.resize(stream.total_out);
+			entry.method = Z_DEFLATED;
+			return true;
+		}
+	}
+	entry.data.swap(contents);
+	return true;
+}
+
+bool WadFile::save_pk3_file(const char* filename, bool drop_contents, const wfSaveOptions &options)
+{
+	// Decide which file each lump goes to
+	vector<wfPk3Entry> entries;
+	int num_lumps = lump_names.size();
+	for (int i = 0; i < num_lumps; i++)
+	{
+		if ((lump_flags[i] & LS_DELETED) || lump_types[i] == LT_MISC_MARKER)
+			continue;
+		wfPk3Entry entry;
+		entry.is_map = lump_types[i] == LT_MAP_HEADER;
+		entry.ready = false;
+		entry.ok = false;
+		entry.lumps.push_back(i);
+		if (entry.is_map)
+		{
+			int count = get_map_lump_count(i);
+			for (int j = i + 1; j <= i + count && j < num_lumps; j++)
+				if (!(lump_flags[j] & LS_DELETED))
+					entry.lumps.push_back(j);
+			i += count;
+			entry.path = string("maps/") + lump_name_strs[entry.lumps[0]].str + ".wad";
+		}
+		else
+		{
+			const char *folder = wfPk3TypeFolder(lump_types[i]);
+			entry.path = string(folder ? folder : "") + (folder ? "/" : "") + lump_name_strs[i].str + ".lmp";
+		}
+		entries.push_back(entry);
+	}
+	// Lumps with the same name would get the same path. As in wad, the last
+	// one overrides the earlier ones, so only the last one is kept.
+	unordered_map<string, unsigned int> last_entry;
+	for (unsigned int j = 0; j < entries.size(); j++)
+		last_entry[entries[j].path] = j;
+	if (last_entry.size() != entries.size())
+	{
+		vector<wfPk3Entry> unique_entries;
+		unique_entries.reserve(last_entry.size());
+		for (unsigned int j = 0; j < entries.size(); j++)
+		{
+			if (last_entry[entries[j].path] == j)
+				unique_entries.push_back(entries[j]);
+			else
+				fprintf(stderr, "Warning: Duplicate file %s in pk3 file %s, keeping the last one\n", entries[j].path.c_str(), filename);
+		}
+		entries.swap(unique_entries);
+	}
+	if (entries.size() > 0xFFFF)
+	{
+		fprintf(stderr, "Too many files for pk3 file %s\n",filename);
+		return false;
+	}
+	FILE *file = fopen(filename, "wb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "Failed to open file for write %s\n",filename);
+		return false;
+	}
+
+	// Entries are packed by worker threads, and written in order by this thread as they get ready.
+	// Workers stay at most a window of entries ahead of the writer, which bounds memory used by packed data.
+	mutex entries_mutex;
+	condition_variable entry_ready;
+	condition_variable entry_written;
+	unsigned int next_entry = 0;
+	unsigned int written_entries = 0;
+	int num_threads = max(options.num_threads, 1);
+	unsigned int window = num_threads * 2;
+	int level = Z_DEFAULT_COMPRESSION;
+	auto pack_entries = [&]()
+	{
+		while (true)
+		{
+			unsigned int j;
+			{
+				unique_lock<mutex> lock(entries_mutex);
+				entry_written.wait(lock, [&]{return next_entry >= entries.size() || next_entry < written_entries + window;});
+				if (next_entry >= entries.size())
+					return;
+				j = next_entry++;
+			}
+			bool ok = pack_pk3_entry(entries[j], level);
+			lock_guard<mutex> lock(entries_mutex);
+			entries[j].ok = ok;
+			entries[j].ready = true;
+			entry_ready.notify_all();
+		}
+	};
+	vector<thread> threads;
+	for (int t = 0; t < num_threads; t++)
+		threads.push_back(thread(pack_entries));
+
+	// Modification time for all files in DOS format
+	time_t now = time(NULL);
+	struct tm *local = localtime(&now);
+	uint16_t mod_time = (local->tm_hour << 11) | (local->tm_min << 5) | (local->tm_sec / 2);
+	uint16_t mod_date = ((local->tm_year - 80) << 9) | ((local->tm_mon + 1) << 5) | local->tm_mday;
+
+	vector<char> directory;
+	uint64_t cur_pos = 0;
+	bool result = true;
+	for (unsigned int j = 0; j < entries.size(); j++)
+	{
+		wfPk3Entry &entry = entries[j];
+		{
+			unique_lock<mutex> lock(entries_mutex);
+			entry_ready.wait(lock, [&]{return entry.ready;});
+			written_entries = j + 1;
+			entry_written.notify_all();
+		}
+		if (!result)
+			continue;
+		if (!entry.ok || cur_pos + sizeof(zip_local_header_t) + entry.path.size() + entry.data.size() > 0xFFFFFFFF)
+		{
+			fprintf(stderr, "Failed to pack file %s for %s\n", entry.path.c_str(), filename);
+			result = false;
+			continue;
+		}
+		zip_local_header_t local_header;
+		memset(&local_header, 0, sizeof(zip_local_header_t));
+		local_header.signature = ZIP_LOCAL_HEADER_SIG;
+		local_header.version_needed = 20;
+		local_header.method = entry.method;
+		local_header.mod_time = mod_time;
+		local_header.mod_date = mod_date;
+		local_header.crc32 = entry.crc32;
+		local_header.packed_size = entry.data.size();
+		local_header.size = entry.size;
+		local_header.name_length = entry.path.size();
+		zip_central_header_t central_header;
+		memset(&central_header, 0, sizeof(zip_central_header_t));
+		central_header.signature = ZIP_CENTRAL_HEADER_SIG;
+		central_header.version_made = 20;
+		central_header.version_needed = 20;
+		central_header.method = entry.method;
+		central_header.mod_time = mod_time;
+		central_header.mod_date = mod_date;
+		central_header.crc32 = entry.crc32;
+		central_header.packed_size = entry.data.size();
+		central_header.size = entry.size;
+		central_header.name_length = entry.path.size();
+		central_header.local_header_pos = cur_pos;
+		directory.insert(directory.end(), (char *)&central_header, (char *)&central_header + sizeof(zip_central_header_t));
+		directory.insert(directory.end(), entry.path.begin(), entry.path.end());
+		result = fwrite(&local_header, sizeof(zip_local_header_t), 1, file) == 1 &&
+			fwrite(entry.path.c_str(), 1, entry.path.size(), file) == entry.path.size() &&
+			(entry.data.empty() || fwrite(&entry.data[0], 1, entry.data.size(), file) == entry.data.size());
+		cur_pos += sizeof(zip_local_header_t) + entry.path.size() + entry.data.size();
+		vector<char>().swap(entry.data);
+	}
+	for (unsigned int t = 0; t < threads.size(); t++)
+		threads[t].join();
+
+	// Write central directory and its end record
+	zip_end_record_t end_record;
+	memset(&end_record, 0, sizeof(zip_end_record_t));
+	end_record.signature = ZIP_END_RECORD_SIG;
+	end_record.disk_entries = entries.size();
+	end_record.total_entries = entries.size();
+	end_record.directory_size = directory.size();
+	end_record.directory_pos = cur_pos;
+	if (result)
+		result = (directory.empty() || fwrite(&directory[0], 1, directory.size(), file) == directory.size()) &&
+			fwrite(&end_record, sizeof(zip_end_record_t), 1, file) == 1;
+	if (fclose(file) != 0)
+		result = false;
+	if (!result)
+		fprintf(stderr, "Failed to write file %s\n",filename);
+
+	if (drop_contents)
+	{
+		for (int i = 0; i < num_lumps; i++)
+			if (!(lump_flags[i] & LS_DELETED))
+				drop_lump_data(i);
+	}
+	return result;
+}
@@ -181,4 +181,60 @@ struct __attribute__((__packed__)) maptexture_t
 	char patchdata[1];
 };
 
+// *********************************************************** //
+// Zip (pk3) archive structures                                //
+// *********************************************************** //
+
+#define ZIP_LOCAL_HEADER_SIG 0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG 0x02014b50
+#define ZIP_END_RECORD_SIG 0x06054b50
+
+struct __attribute__((__packed__)) zip_local_header_t
+{
+	uint32_t signature;
+	uint16_t version_needed;
+	uint16_t flags;
+	uint16_t method;
+	uint16_t mod_time;
+	uint16_t mod_date;
+	uint32_t crc32;
+	uint32_t packed_size;
+	uint32_t size;
+	uint16_t name_length;
+	uint16_t extra_length;
+};
+
+struct __attribute__((__packed__)) zip_central_header_t
+{
+	uint32_t signature;
+	uint16_t version_made;
+	uint16_t version_needed;
+	uint16_t flags;
+	uint16_t method;
+	uint16_t mod_time;
+	uint16_t mod_date;
+	uint32_t crc32;
+	uint32_t packed_size;
+	uint32_t size;
+	uint16_t name_length;
+	uint16_t extra_length;
+	uint16_t comment_length;
+	uint16_t disk_start;
+	uint16_t internal_attr;
+	uint32_t external_attr;
+	uint32_t local_header_pos;
+};
+
+struct __attribute__((__packed__)) zip_end_record_t
+{
+	uint32_t signature;
+	uint16_t disk_num;
+	uint16_t directory_disk;
+	uint16_t disk_entries;
+	uint16_t total_entries;
+	uint32_t directory_size;
+	uint32_t directory_pos;
+	uint16_t comment_length;
+};
+
 #endif // WAD_STRUCTS_H
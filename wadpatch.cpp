@@ -0,0 +1,569 @@
+#include "wad_file.h"
+#include <algorithm>
+#include <getopt.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// *********************************************************** //
+// Patch file format                                           //
+// *********************************************************** //
+
+// Patch file consists of header, one entry per lump of new wad in its
+// directory order, gaps of new wad in file order, and payloads of entries
+// and gaps in the same order. Entries keep file positions of lumps, so that
+// new wad is rebuilt byte for byte, including alignment and shared lumps.
+
+#define PATCH_VERSION 2
+
+struct wad_patch_header_t
+{
+	char magic[4];
+	uint32_t version;
+	char identification[4]; // Of new wad
+	uint32_t num_entries;
+	uint64_t old_manifest_hash; // To check that patch is applied to the right wad
+	uint64_t new_file_size;
+	uint64_t new_file_hash; // compute_hash of whole new wad, to check the result
+	uint32_t directory_pos; // Of new wad
+	uint32_t num_gaps;
+};
+
+enum PatchEntryType
+{
+	PE_COPY, // Copy contents of lump old_lump of old wad
+	PE_DATA, // Contents are stored in patch
+	PE_DELTA, // Contents are rebuilt from lump old_lump of old wad by delta commands
+	PE_SHARED // Data are shared with earlier entry, nothing is written
+};
+
+struct wad_patch_entry_t
+{
+	char name[8];
+	uint32_t file_pos;
+	uint32_t size;
+	uint32_t type;
+	uint32_t old_lump;
+	uint32_t payload_size;
+};
+
+// Part of new wad not covered by header, directory or lump data.
+// Payload size is zero if the gap is filled with zeros.
+struct wad_patch_gap_t
+{
+	uint32_t pos;
+	uint32_t size;
+	uint32_t payload_size;
+};
+
+// Delta payload is a sequence of commands, each followed by insert_size literal bytes.
+// Literal bytes are put into new lump first, then copy_size bytes from old lump.
+struct wad_patch_delta_t
+{
+	uint32_t insert_size;
+	uint32_t copy_offset;
+	uint32_t copy_size;
+};
+
+// Lumps smaller than this are always stored whole
+#define DELTA_MIN_LUMP_SIZE 1024
+// Size of blocks of old lump which can be matched in new lump
+#define DELTA_BLOCK_SIZE 32
+#define DELTA_HASH_MULTIPLIER 0x100000001B3ULL
+
+static uint64_t get_manifest_hash(const wfManifest &manifest)
+{
+	wfHashState state;
+	for (unsigned int i = 0; i < manifest.size(); i++)
+		state.update(&manifest[i], sizeof(wfManifestEntry));
+	return state.digest();
+}
+
+static bool read_whole_file(const char *filename, vector<char> &contents)
+{
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL)
+		return false;
+	contents.clear();
+	char buffer[65536];
+	size_t read_cnt;
+	while ((read_cnt = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		contents.insert(contents.end(), buffer, buffer + read_cnt);
+	bool result = !ferror(file);
+	fclose(file);
+	return result;
+}
+
+static bool get_file_hash(const char *filename, uint64_t &hash)
+{
+	FILE *file = fopen(filename, "rb");
+	if (file == NULL)
+		return false;
+	wfHashState state;
+	char buffer[65536];
+	size_t read_cnt;
+	while ((read_cnt = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		state.update(buffer, read_cnt);
+	bool result = !ferror(file);
+	fclose(file);
+	hash = state.digest();
+	return result;
+}
+
+// *********************************************************** //
+// Delta encoding                                              //
+// *********************************************************** //
+
+static uint64_t block_hash(const uint8_t *data)
+{
+	uint64_t hash = 0;
+	for (int i = 0; i < DELTA_BLOCK_SIZE; i++)
+		hash = hash * DELTA_HASH_MULTIPLIER + data[i];
+	return hash;
+}
+
+// Encode new data as commands copying matching parts of old data.
+// Old data is indexed by blocks, new data is scanned by rolling hash
+// of the same size, so every offset of new data is tried.
+static void encode_delta(const uint8_t *old_data, uint32_t old_size, const uint8_t *new_data, uint32_t new_size, vector<char> &payload)
+{
+	payload.clear();
+	unordered_map<uint64_t, uint32_t> old_blocks;
+	old_blocks.reserve(old_size / DELTA_BLOCK_SIZE);
+	for (uint32_t pos = 0; pos + DELTA_BLOCK_SIZE <= old_size; pos += DELTA_BLOCK_SIZE)
+		old_blocks.insert(make_pair(block_hash(old_data + pos), pos));
+	// Multiplier of byte leaving the rolling window
+	uint64_t out_multiplier = 1;
+	for (int i = 1; i < DELTA_BLOCK_SIZE; i++)
+		out_multiplier *= DELTA_HASH_MULTIPLIER;
+
+	uint32_t literal_start = 0;
+	uint32_t pos = 0;
+	uint64_t hash = (new_size >= DELTA_BLOCK_SIZE) ? block_hash(new_data) : 0;
+	while (pos + DELTA_BLOCK_SIZE <= new_size)
+	{
+		unordered_map<uint64_t, uint32_t>::iterator it = old_blocks.find(hash);
+		if (it != old_blocks.end() && memcmp(old_data + it->second, new_data + pos, DELTA_BLOCK_SIZE) == 0)
+		{
+			// Extend the match in both directions
+			uint32_t old_pos = it->second;
+			uint32_t match_start = pos;
+			while (match_start > literal_start && old_pos > 0 && old_data[old_pos - 1] == new_data[match_start - 1])
+			{
+				match_start--;
+				old_pos--;
+			}
+			uint32_t match_end = pos + DELTA_BLOCK_SIZE;
+			uint32_t old_end = it->second + DELTA_BLOCK_SIZE;
+			while (match_end < new_size && old_end < old_size && old_data[old_end] == new_data[match_end])
+			{
+				match_end++;
+				old_end++;
+			}
+			wad_patch_delta_t command = {match_start - literal_start, old_pos, match_end - match_start};
+			payload.insert(payload.end(), (char *)&command, (char *)&command + sizeof(command));
+			payload.insert(payload.end(), new_data + literal_start, new_data + match_start);
+			literal_start = pos = match_end;
+			if (pos + DELTA_BLOCK_SIZE <= new_size)
+				hash = block_hash(new_data + pos);
+			continue;
+		}
+		// Roll the hash by one byte
+		if (pos + DELTA_BLOCK_SIZE < new_size)
+			hash = (hash - new_data[pos] * out_multiplier) * DELTA_HASH_MULTIPLIER + new_data[pos + DELTA_BLOCK_SIZE];
+		pos++;
+	}
+	// Remaining literal bytes
+	if (literal_start < new_size)
+	{
+		wad_patch_delta_t command = {new_size - literal_start, 0, 0};
+		payload.insert(payload.end(), (char *)&command, (char *)&command + sizeof(command));
+		payload.insert(payload.end(), new_data + literal_start, new_data + new_size);
+	}
+}
+
+static bool decode_delta(const char *old_data, uint32_t old_size, const char *payload, uint32_t payload_size, char *new_data, uint32_t new_size)
+{
+	uint32_t pos = 0;
+	uint32_t new_pos = 0;
+	while (pos < payload_size)
+	{
+		if (payload_size - pos < sizeof(wad_patch_delta_t))
+			return false;
+		wad_patch_delta_t command;
+		memcpy(&command, payload + pos, sizeof(command));
+		pos += sizeof(command);
+		if (command.insert_size > payload_size - pos || command.insert_size > new_size - new_pos)
+			return false;
+		memcpy(new_data + new_pos, payload + pos, command.insert_size);
+		pos += command.insert_size;
+		new_pos += command.insert_size;
+		if (command.copy_offset > old_size || command.copy_size > old_size - command.copy_offset || command.copy_size > new_size - new_pos)
+			return false;
+		memcpy(new_data + new_pos, old_data + command.copy_offset, command.copy_size);
+		new_pos += command.copy_size;
+	}
+	return new_pos == new_size;
+}
+
+// *********************************************************** //
+// Creating patch                                              //
+// *********************************************************** //
+
+static bool create_patch(const char *old_filename, const char *new_filename, const char *patch_filename)
+{
+	WadFile old_wad;
+	WadFile new_wad;
+	if (!old_wad.load_wad_file(old_filename, false, LF_MMAP) || !new_wad.load_wad_file(new_filename, false, LF_MMAP))
+		return false;
+	if (old_wad.is_pk3_file() || new_wad.is_pk3_file())
+	{
+		fprintf(stderr, "Files %s and %s must be wad files.\n", old_filename, new_filename);
+		return false;
+	}
+	wfManifest old_manifest;
+	wfManifest new_manifest;
+	if (!old_wad.build_manifest(old_manifest) || !new_wad.build_manifest(new_manifest))
+	{
+		fprintf(stderr, "Failed to read lumps.\n");
+		return false;
+	}
+	// Raw contents of new wad, for its exact directory and layout
+	vector<char> new_contents;
+	if (!read_whole_file(new_filename, new_contents))
+	{
+		fprintf(stderr, "Failed to read file %s\n", new_filename);
+		return false;
+	}
+	wadinfo_t new_header;
+	memcpy(&new_header, &new_contents[0], sizeof(wadinfo_t));
+	const filelump_t *new_directory = (const filelump_t *)&new_contents[new_header.infotableofs];
+	// Old lump paired with each changed new lump (same name within same map)
+	vector<wfManifestChange> changes;
+	diff_manifest(old_manifest, new_manifest, changes);
+	vector<int> changed_from(new_manifest.size(), -1);
+	for (unsigned int c = 0; c < changes.size(); c++)
+		if (changes[c].flags & MC_CHANGED)
+			changed_from[changes[c].new_pos] = changes[c].old_pos;
+	// Old lumps by their contents, so that any lump of old wad can be copied
+	unordered_map<uint64_t, vector<int> > old_lumps_by_hash;
+	for (unsigned int i = 0; i < old_manifest.size(); i++)
+		if (old_manifest[i].size != 0)
+			old_lumps_by_hash[old_manifest[i].hash].push_back(i);
+
+	wad_patch_header_t header;
+	memcpy(header.magic, "WPAT", 4);
+	header.version = PATCH_VERSION;
+	memcpy(header.identification, new_wad.is_iwad_file() ? "IWAD" : "PWAD", 4);
+	header.num_entries = new_manifest.size();
+	header.old_manifest_hash = get_manifest_hash(old_manifest);
+	header.new_file_size = new_contents.size();
+	header.new_file_hash = compute_hash(&new_contents[0], new_contents.size());
+	header.directory_pos = new_header.infotableofs;
+	vector<wad_patch_entry_t> entries(new_manifest.size());
+	vector<char> payloads;
+	vector<char> delta;
+	// First entry placed at each position, to find lumps sharing their data
+	map<pair<uint32_t, uint32_t>, int> placed_data;
+	int num_copied = 0;
+	int num_delta = 0;
+	int num_stored = 0;
+	for (unsigned int i = 0; i < new_manifest.size(); i++)
+	{
+		wad_patch_entry_t &entry = entries[i];
+		memcpy(entry.name, new_directory[i].name, 8);
+		entry.file_pos = new_directory[i].filepos;
+		entry.size = new_manifest[i].size;
+		entry.type = PE_DATA;
+		entry.old_lump = 0;
+		entry.payload_size = 0;
+		if (entry.size == 0)
+			continue;
+		if (!placed_data.insert(make_pair(make_pair(entry.file_pos, entry.size), i)).second)
+		{
+			entry.type = PE_SHARED;
+			continue;
+		}
+		const char *new_data = new_wad.get_lump_data(i);
+		// Identical lump exists in old wad
+		unordered_map<uint64_t, vector<int> >::iterator it = old_lumps_by_hash.find(new_manifest[i].hash);
+		if (it != old_lumps_by_hash.end())
+		{
+			for (unsigned int c = 0; c < it->second.size() && entry.type == PE_DATA; c++)
+			{
+				int old_lump = it->second[c];
+				if (old_manifest[old_lump].size == entry.size && memcmp(old_wad.get_lump_data(old_lump), new_data, entry.size) == 0)
+				{
+					entry.type = PE_COPY;
+					entry.old_lump = old_lump;
+					num_copied++;
+				}
+			}
+			if (entry.type == PE_COPY)
+				continue;
+		}
+		// Large changed lump, store just the differences if it pays off
+		int old_lump = changed_from[i];
+		if (old_lump != -1 && entry.size >= DELTA_MIN_LUMP_SIZE && old_manifest[old_lump].size >= DELTA_MIN_LUMP_SIZE)
+		{
+			encode_delta((uint8_t *)old_wad.get_lump_data(old_lump), old_manifest[old_lump].size, (uint8_t *)new_data, entry.size, delta);
+			if (delta.size() < entry.size / 4 * 3)
+			{
+				entry.type = PE_DELTA;
+				entry.old_lump = old_lump;
+				entry.payload_size = delta.size();
+				payloads.insert(payloads.end(), delta.begin(), delta.end());
+				num_delta++;
+				continue;
+			}
+		}
+		entry.payload_size = entry.size;
+		num_stored++;
+		payloads.insert(payloads.end(), new_data, new_data + entry.size);
+	}
+
+	// Find gaps between header, directory and lump data of new wad
+	vector<pair<uint64_t, uint64_t> > covered;
+	covered.push_back(make_pair(0, sizeof(wadinfo_t)));
+	covered.push_back(make_pair(new_header.infotableofs, new_header.infotableofs + (uint64_t)sizeof(filelump_t) * entries.size()));
+	for (unsigned int i = 0; i < entries.size(); i++)
+		if (entries[i].size != 0)
+			covered.push_back(make_pair(entries[i].file_pos, (uint64_t)entries[i].file_pos + entries[i].size));
+	sort(covered.begin(), covered.end());
+	covered.push_back(make_pair(new_contents.size(), new_contents.size()));
+	vector<wad_patch_gap_t> gaps;
+	uint64_t covered_end = 0;
+	for (unsigned int c = 0; c < covered.size(); c++)
+	{
+		if (covered[c].first > covered_end)
+		{
+			wad_patch_gap_t gap = {(uint32_t)covered_end, (uint32_t)(covered[c].first - covered_end), 0};
+			const char *data = &new_contents[gap.pos];
+			if ((uint32_t)count(data, data + gap.size, 0) != gap.size)
+			{
+				gap.payload_size = gap.size;
+				payloads.insert(payloads.end(), data, data + gap.size);
+			}
+			gaps.push_back(gap);
+		}
+		covered_end = max(covered_end, covered[c].second);
+	}
+	header.num_gaps = gaps.size();
+
+	FILE *patch_file = fopen(patch_filename, "wb");
+	if (patch_file == NULL)
+	{
+		fprintf(stderr, "Failed to open file for write %s\n", patch_filename);
+		return false;
+	}
+	bool result = fwrite(&header, sizeof(header), 1, patch_file) == 1 &&
+		(entries.empty() || fwrite(&entries[0], sizeof(wad_patch_entry_t), entries.size(), patch_file) == entries.size()) &&
+		(gaps.empty() || fwrite(&gaps[0], sizeof(wad_patch_gap_t), gaps.size(), patch_file) == gaps.size()) &&
+		(payloads.empty() || fwrite(&payloads[0], 1, payloads.size(), patch_file) == payloads.size());
+	if (fclose(patch_file) != 0 || !result)
+	{
+		fprintf(stderr, "Failed to write file %s\n", patch_filename);
+		return false;
+	}
+	printf("Lumps: %5d copied\n", num_copied);
+	printf("       %5d delta\n", num_delta);
+	printf("       %5d stored\n", num_stored);
+	printf("Patch size: %u bytes\n", (unsigned int)(sizeof(header) + entries.size() * sizeof(wad_patch_entry_t) + gaps.size() * sizeof(wad_patch_gap_t) + payloads.size()));
+	return true;
+}
+
+// *********************************************************** //
+// Applying patch                                              //
+// *********************************************************** //
+
+static bool apply_patch(const char *old_filename, const char *patch_filename, const char *new_filename)
+{
+	WadFile old_wad;
+	if (!old_wad.load_wad_file(old_filename, false, LF_MMAP))
+		return false;
+	if (old_wad.is_pk3_file())
+	{
+		fprintf(stderr, "Old file %s must be a wad file.\n", old_filename);
+		return false;
+	}
+	// Load whole patch
+	vector<char> patch;
+	if (!read_whole_file(patch_filename, patch))
+	{
+		fprintf(stderr, "Failed to open patch file %s\n", patch_filename);
+		return false;
+	}
+	wad_patch_header_t header;
+	memset(&header, 0, sizeof(header));
+	if (patch.size() >= sizeof(header))
+		memcpy(&header, &patch[0], sizeof(header));
+	if (strncmp(header.magic, "WPAT", 4) != 0 || header.version != PATCH_VERSION ||
+		header.num_entries > (patch.size() - sizeof(header)) / sizeof(wad_patch_entry_t) ||
+		header.num_gaps > (patch.size() - sizeof(header) - header.num_entries * sizeof(wad_patch_entry_t)) / sizeof(wad_patch_gap_t) ||
+		header.new_file_size > 0xFFFFFFFF ||
+		header.directory_pos + (uint64_t)sizeof(filelump_t) * header.num_entries > header.new_file_size)
+	{
+		fprintf(stderr, "File %s is not a valid patch file.\n", patch_filename);
+		return false;
+	}
+	vector<wad_patch_entry_t> entries(header.num_entries);
+	if (header.num_entries != 0)
+		memcpy(&entries[0], &patch[sizeof(header)], header.num_entries * sizeof(wad_patch_entry_t));
+	vector<wad_patch_gap_t> gaps(header.num_gaps);
+	size_t payload_pos = sizeof(header) + header.num_entries * sizeof(wad_patch_entry_t);
+	if (header.num_gaps != 0)
+		memcpy(&gaps[0], &patch[payload_pos], header.num_gaps * sizeof(wad_patch_gap_t));
+	payload_pos += header.num_gaps * sizeof(wad_patch_gap_t);
+	// Check that patch belongs to the old wad
+	wfManifest old_manifest;
+	if (!old_wad.build_manifest(old_manifest) || get_manifest_hash(old_manifest) != header.old_manifest_hash)
+	{
+		fprintf(stderr, "Patch %s was not made for wad file %s.\n", patch_filename, old_filename);
+		return false;
+	}
+
+	// New wad gets its final size first, then all parts are written at their positions
+	int old_fd = open(old_filename, O_RDONLY | O_BINARY);
+	int new_fd = open(new_filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+	if (old_fd == -1 || new_fd == -1)
+	{
+		fprintf(stderr, "Failed to open file for write %s\n", new_filename);
+		if (old_fd != -1) close(old_fd);
+		if (new_fd != -1) close(new_fd);
+		return false;
+	}
+	bool result = ftruncate(new_fd, header.new_file_size) == 0;
+	vector<filelump_t> directory(entries.size());
+	for (unsigned int i = 0; i < entries.size(); i++)
+	{
+		memcpy(directory[i].name, entries[i].name, 8);
+		directory[i].filepos = entries[i].file_pos;
+		directory[i].size = entries[i].size;
+		if ((uint64_t)entries[i].file_pos + entries[i].size > header.new_file_size)
+			result = false;
+	}
+	wadinfo_t wad_header;
+	memcpy(wad_header.identification, header.identification, 4);
+	wad_header.numnlumps = entries.size();
+	wad_header.infotableofs = header.directory_pos;
+	if (result)
+		result = write_all(new_fd, (char *)&wad_header, sizeof(wadinfo_t), 0);
+	// Unchanged lumps stored next to each other in both wads are copied as single range
+	uint32_t copy_pos = 0;
+	uint32_t copy_dst_pos = 0;
+	uint32_t copy_size = 0;
+	vector<char> lump;
+	for (unsigned int i = 0; i < entries.size() && result; i++)
+	{
+		wad_patch_entry_t &entry = entries[i];
+		if (entry.size == 0 || entry.type == PE_SHARED)
+			continue;
+		bool valid_old_lump = entry.old_lump < old_manifest.size();
+		if (entry.type == PE_COPY && valid_old_lump && old_manifest[entry.old_lump].size == entry.size)
+		{
+			uint32_t old_pos = old_manifest[entry.old_lump].file_pos;
+			if (copy_size != 0 && copy_pos + copy_size == old_pos && copy_dst_pos + copy_size == entry.file_pos)
+				copy_size += entry.size;
+			else
+			{
+				result = copy_size == 0 || copy_file_data(old_fd, copy_pos, new_fd, copy_dst_pos, copy_size);
+				copy_pos = old_pos;
+				copy_dst_pos = entry.file_pos;
+				copy_size = entry.size;
+			}
+			continue;
+		}
+		result = copy_size == 0 || copy_file_data(old_fd, copy_pos, new_fd, copy_dst_pos, copy_size);
+		copy_size = 0;
+		if (!result)
+			break;
+		if (entry.payload_size > patch.size() - payload_pos)
+			result = false;
+		else if (entry.type == PE_DATA && entry.payload_size == entry.size)
+			result = write_all(new_fd, &patch[payload_pos], entry.size, entry.file_pos);
+		else if (entry.type == PE_DELTA && valid_old_lump)
+		{
+			lump.resize(entry.size + 1);
+			const char *old_data = old_wad.get_lump_data(entry.old_lump);
+			result = old_data != NULL &&
+				decode_delta(old_data, old_manifest[entry.old_lump].size, &patch[payload_pos], entry.payload_size, &lump[0], entry.size) &&
+				write_all(new_fd, &lump[0], entry.size, entry.file_pos);
+		}
+		else
+			result = false;
+		payload_pos += entry.payload_size;
+	}
+	if (result && copy_size != 0)
+		result = copy_file_data(old_fd, copy_pos, new_fd, copy_dst_pos, copy_size);
+	// Gaps which are not just zeros
+	for (unsigned int g = 0; g < gaps.size() && result; g++)
+	{
+		if (gaps[g].payload_size == 0)
+			continue;
+		result = gaps[g].payload_size == gaps[g].size && gaps[g].size <= patch.size() - payload_pos &&
+			(uint64_t)gaps[g].pos + gaps[g].size <= header.new_file_size &&
+			write_all(new_fd, &patch[payload_pos], gaps[g].size, gaps[g].pos);
+		payload_pos += gaps[g].payload_size;
+	}
+	if (result && !directory.empty())
+		result = write_all(new_fd, (char *)&directory[0], sizeof(filelump_t) * directory.size(), header.directory_pos);
+	close(old_fd);
+	if (close(new_fd) != 0)
+		result = false;
+	// Check that the result is exactly the new wad
+	uint64_t new_file_hash;
+	if (result && (!get_file_hash(new_filename, new_file_hash) || new_file_hash != header.new_file_hash))
+	{
+		fprintf(stderr, "Patched file %s does not match the wad the patch was made from.\n", new_filename);
+		unlink(new_filename);
+		return false;
+	}
+	if (!result)
+	{
+		fprintf(stderr, "Failed to apply patch %s, it is damaged or file %s could not be written.\n", patch_filename, new_filename);
+		unlink(new_filename);
+	}
+	return result;
+}
+
+int main (int argc, char *argv[])
+{
+	if (argc < 5)
+	{
+		printf("Usage: %s -c oldwad newwad patchfile\n", argv[0]);
+		printf("       %s -a oldwad patchfile newwad\n", argv[0]);
+		printf("  -c: Create patch containing differences between old and new wad\n");
+		printf("  -a: Apply patch to old wad, making new wad\n");
+		return 1;
+	}
+
+	// Parse arguments
+	bool arg_create = false;
+	bool arg_apply = false;
+	int c;
+	while ((c = getopt(argc, argv, "ca")) != -1)
+	{
+		if (c == 'c')
+			arg_create = true;
+		else if (c == 'a')
+			arg_apply = true;
+		else
+			return 1;
+	}
+	if (arg_create == arg_apply || argc - optind != 3)
+	{
+		fprintf(stderr, "You must specify either -c or -a, and three filenames.\n");
+		return 1;
+	}
+
+	if (arg_create)
+		return create_patch(argv[optind], argv[optind + 1], argv[optind + 2]) ? 0 : 2;
+	return apply_patch(argv[optind], argv[optind + 1], argv[optind + 2]) ? 0 : 2;
+}